@@ -0,0 +1,33 @@
+/* Test whether we have an assembler context switch for this machine.
+ * - by Richard W.M. Jones <rich@annexia.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+
+/* This must match the architectures supported in src/pthr_context.c. */
+#if !defined(__GNUC__) || (!defined(__x86_64__) && !defined(__aarch64__))
+#error "no assembler context switch for this architecture"
+#endif
+
+int
+main ()
+{
+  printf ("ok\n");
+  return 0;
+}
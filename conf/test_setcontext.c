@@ -26,6 +26,7 @@
 #define MAGIC 0x14151617
 
 static void fn (int);
+static char stack[65536];
 
 int
 main ()
@@ -35,6 +36,10 @@ main ()
   if (getcontext (&ucp) == -1)
     exit (1);
 
+  ucp.uc_link = 0;
+  ucp.uc_stack.ss_sp = stack;
+  ucp.uc_stack.ss_size = sizeof stack;
+  ucp.uc_stack.ss_flags = 0;
   makecontext (&ucp, fn, 1, MAGIC);
 
   setcontext (&ucp);
@@ -6,6 +6,11 @@
 # in glibc, but the functions were null. Duh! So the only way to
 # determine if these functions are implemented and actually work
 # is to try them out.
+#
+# On architectures where we have a hand-written context switch
+# (see src/pthr_context.c) we prefer that, because swapcontext
+# makes a sigprocmask system call on every switch. Set
+# PTHRLIB_ASM_CONTEXT=no in the environment to disable it.
 
 result=no
 
@@ -22,3 +27,20 @@ if [ "x$result" = "xyes" ]; then
 else
     echo "/* #define HAVE_WORKING_SETCONTEXT 1 */" >> config.h
 fi
+
+result=no
+
+if [ "x$PTHRLIB_ASM_CONTEXT" != "xno" ] && \
+    $CC $CFLAGS \
+    $srcdir/conf/test_asmcontext.c -o conf/test_asmcontext 2>/dev/null
+then
+    if conf/test_asmcontext | grep 'ok' >/dev/null 2>&1; then
+	result=yes
+    fi
+fi
+
+if [ "x$result" = "xyes" ]; then
+    echo "#define HAVE_ASM_CONTEXT 1" >> config.h
+else
+    echo "/* #define HAVE_ASM_CONTEXT 1 */" >> config.h
+fi
@@ -0,0 +1,150 @@
+/* Connection rate benchmark for pthr_eg1_echo.
+ * Copyright (C) 2003 Richard W.M. Jones <rich@annexia.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+/* Usage: pthr_eg1_bench [-a address] [-p port] [-c clients] [-t seconds]
+ *
+ * Each client repeatedly connects to the server, sends a request,
+ * reads the reply and closes the connection. At the end, prints the
+ * number of connections completed per second.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+#include <pool.h>
+
+#include "src/pthr_reactor.h"
+#include "src/pthr_pseudothread.h"
+#include "src/pthr_iolib.h"
+
+static struct sockaddr_in addr;
+static int stop = 0;
+static int nr_connections = 0, nr_errors = 0;
+
+static void
+run_client (void *vp)
+{
+  char buf[4096];
+  io_handle io;
+  int sock;
+
+  while (!stop)
+    {
+      sock = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
+      if (sock < 0) { perror ("socket"); exit (1); }
+      if (fcntl (sock, F_SETFL, O_NONBLOCK) < 0) abort ();
+
+      if (pth_connect (sock, (struct sockaddr *) &addr, sizeof addr) < 0)
+	{
+	  close (sock);
+	  nr_errors++;
+	  pth_millisleep (10);
+	  continue;
+	}
+
+      io = io_fdopen (sock);
+      io_fputs ("GET /bench HTTP/1.0\r\n\r\n", io);
+      io_fflush (io);
+      while (io_fread (buf, 1, sizeof buf, io) > 0)
+	;
+      io_fclose (io);
+
+      nr_connections++;
+    }
+}
+
+static void
+run_timer (void *vp)
+{
+  pth_sleep (*(int *) vp);
+  stop = 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *address = "127.0.0.1";
+  int port = 8002, clients = 100, seconds = 10, c, i;
+  reactor_time_t start;
+  double elapsed;
+
+  while ((c = getopt (argc, argv, "a:p:c:t:")) != -1)
+    {
+      switch (c)
+	{
+	case 'a': address = optarg; break;
+	case 'p': port = atoi (optarg); break;
+	case 'c': clients = atoi (optarg); break;
+	case 't': seconds = atoi (optarg); break;
+	default:
+	  fprintf (stderr,
+		   "usage: pthr_eg1_bench [-a address] [-p port] "
+		   "[-c clients] [-t seconds]\n");
+	  exit (1);
+	}
+    }
+
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr (address);
+  addr.sin_port = htons (port);
+
+  start = reactor_time;
+
+  for (i = 0; i < clients; ++i)
+    pth_start (new_pseudothread (new_pool (), run_client, 0, "client"));
+  pth_start (new_pseudothread (new_pool (), run_timer, &seconds, "timer"));
+
+  while (pseudothread_count_threads () > 0)
+    reactor_invoke ();
+
+  elapsed = (reactor_time - start) / 1000.;
+  printf ("%d connections in %.1f seconds: %.0f connections/second "
+	  "(%d errors)\n",
+	  nr_connections, elapsed, nr_connections / elapsed, nr_errors);
+
+  exit (0);
+}
@@ -70,6 +70,9 @@ struct eg2_server_processor
   /* Pool for memory allocations. */
   struct pool *pool;
 
+  /* Arena for per-request memory allocations. */
+  http_arena arena;
+
   /* HTTP request. */
   http_request http_request;
 
@@ -110,39 +113,31 @@ run (void *vp)
   struct stat statbuf;
 
   p->io = io_fdopen (p->sock);
+  p->arena = new_http_arena (p->pool);
 
   /* Sit in a loop reading HTTP requests. */
   while (!close)
     {
       /* ----- HTTP request ----- */
-      p->http_request = new_http_request (p->pool, p->io);
+      p->http_request = http_request_begin (p->arena, p->io);
       if (p->http_request == 0)	/* Normal end of file. */
         break;
 
       /* Get the path and locate the file. */
       path = http_request_path (p->http_request);
       if (stat (path, &statbuf) == -1)
-	{
-	  close = file_not_found_error (p);
-	  continue;
-	}
+	close = file_not_found_error (p);
 
       /* File or directory? */
-      if (S_ISDIR (statbuf.st_mode))
-	{
-	  close = serve_directory (p, path, &statbuf);
-	  continue;
-	}
+      else if (S_ISDIR (statbuf.st_mode))
+	close = serve_directory (p, path, &statbuf);
       else if (S_ISREG (statbuf.st_mode))
-	{
-	  close = serve_file (p, path, &statbuf);
-	  continue;
-	}
+	close = serve_file (p, path, &statbuf);
       else
-	{
-	  close = file_not_found_error (p);
-	  continue;
-	}
+	close = file_not_found_error (p);
+
+      /* Free up memory used by this request. */
+      http_request_end (p->arena);
     }
 
   io_fclose (p->io);
@@ -222,7 +217,7 @@ serve_directory (eg2_server_processor p, const char *path,
    */
   if (path[strlen (path)-1] != '/')
     {
-      char *location = psprintf (p->pool, "%s/", path);
+      char *location = psprintf (http_arena_pool (p->arena), "%s/", path);
       return moved_permanently (p, location);
     }
 
@@ -240,7 +235,11 @@ serve_directory (eg2_server_processor p, const char *path,
 			      NULL);
   close = http_response_end_headers (http_response);
 
-  if (http_request_is_HEAD (p->http_request)) return close;
+  if (http_request_is_HEAD (p->http_request))
+    {
+      closedir (dir);
+      return close;
+    }
 
   io_fprintf (p->io,
 	      "<html><head><title>Directory: %s</title></head>" CRLF
@@ -259,7 +258,7 @@ serve_directory (eg2_server_processor p, const char *path,
 	  struct stat fstatbuf;
 
 	  /* Generate the full pathname to this file. */
-	  filename = psprintf (p->pool, "%s/%s", path, d->d_name);
+	  filename = psprintf (http_arena_pool (p->arena), "%s/%s", path, d->d_name);
 
 	  /* Stat the file to find out what it is. */
 	  if (lstat (filename, &fstatbuf) == 0)
@@ -307,6 +306,8 @@ serve_directory (eg2_server_processor p, const char *path,
   io_fprintf (p->io,
 	      "</table></body></html>" CRLF);
 
+  closedir (dir);
+
   return close;
 }
 
@@ -315,10 +316,7 @@ serve_file (eg2_server_processor p, const char *path,
 	    const struct stat *statbuf)
 {
   http_response http_response;
-  const int n = 4096;
-  char *buffer = alloca (n);
-  int cl, fd, r;
-  char *content_length = pitoa (p->pool, statbuf->st_size);
+  int cl, fd;
 
   fd = open (path, O_RDONLY);
   if (fd < 0)
@@ -329,20 +327,9 @@ serve_file (eg2_server_processor p, const char *path,
   http_response_send_headers (http_response,
 			      /* Content type. */
 			      "Content-Type", "text/plain",
-			      "Content-Length", content_length,
 			      /* End of headers. */
 			      NULL);
-  cl = http_response_end_headers (http_response);
-
-  if (http_request_is_HEAD (p->http_request)) return cl;
-
-  while ((r = read (fd, buffer, n)) > 0)
-    {
-      io_fwrite (buffer, r, 1, p->io);
-    }
-
-  if (r < 0)
-    perror ("read");
+  cl = http_response_send_file (http_response, fd, 0, statbuf->st_size);
 
   close (fd);
 
@@ -47,6 +47,7 @@ int
 main (int argc, char *argv[])
 {
   struct sigaction sa;
+  int i;
 
   /* Intercept signals. */
   memset (&sa, 0, sizeof sa);
@@ -61,6 +62,11 @@ main (int argc, char *argv[])
   sa.sa_flags = SA_RESTART;
   sigaction (SIGPIPE, &sa, 0);
 
+  /* Run one worker process per processor (-n). */
+  for (i = 1; i < argc - 1; ++i)
+    if (strcmp (argv[i], "-n") == 0)
+      pthr_server_workers (atoi (argv[i+1]));
+
   /* Start up the server. */
   pthr_server_chroot (root);
   pthr_server_username (user);
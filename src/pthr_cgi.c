@@ -21,8 +21,17 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
@@ -39,15 +48,47 @@
 #include "pthr_http.h"
 #include "pthr_cgi.h"
 
+/* Size of the buffer used to read POST bodies. */
+#define BUFFER_SIZE 8192
+
+/* Longest field name accepted in an urlencoded POST body. */
+#define MAX_NAME_LENGTH 1024
+
 static int post_max = -1;
+static int spill_size = 65536;
+static char *one = "1";
 
 static void parse_qs (cgi, const char *qs);
 static void insert_param (cgi, char *name, char *value);
+static int read_urlencoded (cgi, http_request, io_handle, pool tmp);
+static int read_multipart (cgi, http_request, io_handle, pool tmp, const char *content_type);
 
 struct cgi
 {
   pool pool;			/* Pool for allocations. */
   shash params;			/* Parameters (hash of string -> vector). */
+  shash files;			/* Temporary files (hash of string -> char *). */
+};
+
+/* A buffer which grows as data is appended to it. */
+struct buffer
+{
+  char *data;
+  int used, size;
+};
+
+/* A field being read from a POST body. Values are kept in memory,
+ * except that uploaded files (fields with a filename) larger than
+ * spill_size are written to a temporary file instead.
+ */
+struct field
+{
+  cgi c;
+  char *name;			/* Name of the field. */
+  char *filename;		/* Filename sent by the client, or NULL. */
+  struct buffer *value;		/* Value, while it is held in memory. */
+  int fd;			/* Temporary file, or -1. */
+  char *path;			/* Name of the temporary file. */
 };
 
 int
@@ -62,6 +103,18 @@ cgi_set_post_max (int new_post_max)
   return post_max = new_post_max;
 }
 
+int
+cgi_get_spill_size (void)
+{
+  return spill_size;
+}
+
+int
+cgi_set_spill_size (int new_spill_size)
+{
+  return spill_size = new_spill_size;
+}
+
 cgi
 new_cgi (struct pool *pool, http_request h, io_handle io)
 {
@@ -69,6 +122,7 @@ new_cgi (struct pool *pool, http_request h, io_handle io)
 
   c->pool = pool;
   c->params = new_shash (pool, vector);
+  c->files = new_shash (pool, char *);
 
   if (http_request_method (h) != HTTP_METHOD_POST)
     {
@@ -81,10 +135,10 @@ new_cgi (struct pool *pool, http_request h, io_handle io)
       const char *content_length_s =
 	http_request_get_header (h, "Content-Length");
       const char *content_type = http_request_get_header (h, "Content-Type");
-      int content_length = -1;
+      int content_length = -1, r;
       const char std_type[] = "application/x-www-form-urlencoded";
-      struct pool *tmp = new_subpool (pool);
-      char *content;
+      const char multipart_type[] = "multipart/form-data";
+      struct pool *tmp;
 
       if (content_length_s &&
 	  sscanf (content_length_s, "%d", &content_length) != 1)
@@ -96,49 +150,467 @@ new_cgi (struct pool *pool, http_request h, io_handle io)
 
       /* Check content type. If missing, assume it defaults to the
        * standard application/x-www-form-urlencoded.
-       */
-      if (content_type &&
-	  strncasecmp (content_type, std_type, strlen (std_type)) != 0)
-	return 0;		/* Unexpected/unknown content type. */
-
-      /* Read the content, either to the end of input of else to the
-       * expected length. Note that Netscape 4 sends an extra CRLF
-       * after the POST data with is explicitly forbidden (see:
+       *
+       * The body is parsed as it is read, so that large uploads don't
+       * have to be held in memory. Note that Netscape 4 sends an extra
+       * CRLF after the POST data with is explicitly forbidden (see:
        * RFC 2616, section 4.1). We ignore these next time around when
        * we are reading the next request (see code in new_http_request).
        */
-      if (content_length >= 0)
-	{
-	  content = pmalloc (tmp, content_length + 1);
-	  if (io_fread (content, 1, content_length, io) < content_length)
-	    return 0;
+      tmp = new_subpool (pool);
+      if (!content_type ||
+	  strncasecmp (content_type, std_type, strlen (std_type)) == 0)
+	r = read_urlencoded (c, h, io, tmp);
+      else if (strncasecmp (content_type, multipart_type,
+			    strlen (multipart_type)) == 0)
+	r = read_multipart (c, h, io, tmp, content_type);
+      else
+	r = -1;			/* Unexpected/unknown content type. */
+      delete_pool (tmp);
 
-	  content[content_length] = '\0';
+      if (r == -1)
+	return 0;
+    }
+
+  return c;
+}
+
+static inline int
+hex_to_int (char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  else if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  else if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  else return -1;
+}
+
+/* Read the next piece of the POST body, checking it isn't too long. */
+static int
+read_post (http_request h, io_handle io, char *buf, int len, int *total)
+{
+  int r = http_request_read_body (h, io, buf, len);
+
+  if (r > 0)
+    {
+      *total += r;
+      if (post_max >= 0 && *total > post_max)
+	return -1;		/* Content too long. */
+    }
+  return r;
+}
+
+static void
+buffer_append (pool pool, struct buffer *b, const char *data, int len)
+{
+  if (b->used + len > b->size)
+    {
+      do
+	b->size = b->size ? b->size * 2 : 256;
+      while (b->used + len > b->size);
+
+      b->data = b->data
+	? prealloc (pool, b->data, b->size)
+	: pmalloc (pool, b->size);
+    }
+
+  memcpy (b->data + b->used, data, len);
+  b->used += len;
+}
+
+static int
+write_all (int fd, const char *data, int len)
+{
+  int r;
+
+  while (len > 0)
+    {
+      r = write (fd, data, len);
+      if (r == -1)
+	{
+	  if (errno == EINTR) continue;
+	  return -1;
 	}
-      else
+      data += r;
+      len -= r;
+    }
+  return 0;
+}
+
+static void
+unlink_file (void *path)
+{
+  unlink ((char *) path);
+}
+
+static void
+start_field (cgi c, struct field *f, struct buffer *value,
+	     char *name, char *filename)
+{
+  f->c = c;
+  f->name = name;
+  f->filename = filename;
+  f->value = value;
+  f->value->used = 0;
+  f->fd = -1;
+  f->path = 0;
+}
+
+/* Move the value to a temporary file, which is deleted along with
+ * the CGI object.
+ */
+static int
+spill_field (struct field *f)
+{
+  const char *tmpdir = getenv ("TMPDIR");
+
+  if (!tmpdir || tmpdir[0] == '\0') tmpdir = "/tmp";
+
+  f->path = psprintf (f->c->pool, "%s/pthrcgiXXXXXX", tmpdir);
+  f->fd = mkstemp (f->path);
+  if (f->fd == -1)
+    return -1;
+  pool_register_cleanup_fn (f->c->pool, unlink_file, f->path);
+
+  return write_all (f->fd, f->value->data, f->value->used);
+}
+
+static int
+field_write (pool tmp, struct field *f, const char *data, int len)
+{
+  if (f->fd == -1 && f->filename && f->value->used + len > spill_size)
+    {
+      if (spill_field (f) == -1)
+	return -1;
+    }
+
+  if (f->fd >= 0)
+    return write_all (f->fd, data, len);
+
+  buffer_append (tmp, f->value, data, len);
+  return 0;
+}
+
+/* Finish the field and add it to the parameters. */
+static void
+end_field (struct field *f)
+{
+  cgi c = f->c;
+  char *value, *path;
+
+  if (f->fd >= 0)
+    {
+      close (f->fd);
+      f->fd = -1;
+
+      value = f->filename ? f->filename : "";
+      if (!shash_get (c->files, f->name, path))
+	shash_insert (c->files, f->name, f->path);
+    }
+  else
+    value = pstrndup (c->pool, f->value->used ? f->value->data : "",
+		      f->value->used);
+
+  insert_param (c, f->name, value);
+}
+
+static void
+abort_field (struct field *f)
+{
+  if (f->fd >= 0)
+    {
+      close (f->fd);
+      f->fd = -1;
+    }
+}
+
+/* Parse an application/x-www-form-urlencoded body as it is read. Names
+ * are not unescaped (as in parse_qs). Values are unescaped as they
+ * arrive, and a %-escape may be split across two reads.
+ */
+static int
+read_urlencoded (cgi c, http_request h, io_handle io, pool tmp)
+{
+  char *buf = pmalloc (tmp, BUFFER_SIZE);
+  char *out = pmalloc (tmp, BUFFER_SIZE + 2);
+  struct buffer name = { 0, 0, 0 }, value = { 0, 0, 0 };
+  struct field f;
+  int in_value = 0, pct = 0, total = 0, r, i, j, a, b;
+  char ch, hi = 0;
+
+  f.fd = -1;
+
+  while ((r = read_post (h, io, buf, BUFFER_SIZE, &total)) > 0)
+    {
+      for (i = 0, j = 0; i < r; ++i)
 	{
-	  char t[1024];
-	  int r, n = 0;
+	  ch = buf[i];
 
-	  content = pstrdup (tmp, "");
+	  if (!in_value)
+	    {
+	      if (ch == '=')
+		{
+		  start_field (c, &f, &value,
+			       pstrndup (c->pool, name.used ? name.data : "",
+					 name.used),
+			       0);
+		  in_value = 1;
+		}
+	      else if (ch == '&')
+		{
+		  /* No '=' char found? Assume it's a parameter of the
+		   * form name=1.
+		   */
+		  if (name.used > 0)
+		    insert_param (c, pstrndup (c->pool, name.data, name.used),
+				  one);
+		  name.used = 0;
+		}
+	      else if (name.used >= MAX_NAME_LENGTH)
+		goto error;	/* Name too long. */
+	      else
+		buffer_append (tmp, &name, &ch, 1);
+	      continue;
+	    }
 
-	  while ((r = io_fread (t, 1, 1024, io)) > 0)
+	  /* Finish off a %-escape. Invalid escapes are passed through. */
+	  if (pct == 1)
 	    {
-	      n += r;
-	      if (post_max >= 0 && n > post_max)
-		return 0;	/* Content too long. */
+	      if (hex_to_int (ch) >= 0) { hi = ch; pct = 2; continue; }
+	      out[j++] = '%';
+	      pct = 0;
+	    }
+	  else if (pct == 2)
+	    {
+	      a = hex_to_int (hi);
+	      b = hex_to_int (ch);
+	      pct = 0;
+	      if (b >= 0) { out[j++] = a << 4 | b; continue; }
+	      out[j++] = '%';
+	      out[j++] = hi;
+	    }
 
-	      t[r] = '\0';
-	      content = pstrcat (tmp, content, t);
+	  if (ch == '&')
+	    {
+	      if (field_write (tmp, &f, out, j) == -1)
+		goto error;
+	      j = 0;
+	      end_field (&f);
+	      in_value = 0;
+	      name.used = 0;
 	    }
+	  else if (ch == '%')
+	    pct = 1;
+	  else if (ch == '+')
+	    out[j++] = ' ';
+	  else
+	    out[j++] = ch;
 	}
 
-      parse_qs (c, content);
+      if (in_value && field_write (tmp, &f, out, j) == -1)
+	goto error;
+    }
+  if (r == -1)
+    goto error;
 
-      delete_pool (tmp);
+  if (in_value)
+    {
+      if (pct >= 1) { out[0] = '%'; out[1] = hi; }
+      if (field_write (tmp, &f, out, pct) == -1)
+	goto error;
+      end_field (&f);
     }
+  else if (name.used > 0)
+    insert_param (c, pstrndup (c->pool, name.data, name.used), one);
 
-  return c;
+  return 0;
+
+ error:
+  abort_field (&f);
+  return -1;
+}
+
+/* Return the parameter called key from a header such as
+ * 'form-data; name="file"; filename="a.txt"', or NULL if it is
+ * not present.
+ */
+static char *
+get_header_param (pool pool, const char *str, const char *key)
+{
+  int len = strlen (key);
+  const char *p = str, *end;
+
+  while (*p)
+    {
+      if (*p == '"')		/* Skip quoted strings. */
+	{
+	  p = strchr (p+1, '"');
+	  if (!p) return 0;
+	  p++;
+	  continue;
+	}
+      if (*p++ != ';')
+	continue;
+
+      while (*p == ' ' || *p == '\t') p++;
+      if (strncasecmp (p, key, len) == 0 && p[len] == '=')
+	{
+	  p += len+1;
+	  if (*p == '"')
+	    {
+	      p++;
+	      end = strchr (p, '"');
+	      if (!end) end = p + strlen (p);
+	    }
+	  else
+	    end = p + strcspn (p, "; \t");
+	  return pstrndup (pool, p, end - p);
+	}
+    }
+
+  return 0;
+}
+
+/* Find the delimiter in the buffer, returning its offset or -1. */
+static int
+find_delimiter (const char *buf, int n, const char *delim, int len)
+{
+  const char *p = buf, *end = buf + n - len;
+
+  while (p <= end && (p = memchr (p, '\r', end - p + 1)) != 0)
+    {
+      if (memcmp (p, delim, len) == 0)
+	return p - buf;
+      p++;
+    }
+  return -1;
+}
+
+static char *
+find_crlf (char *buf, int n)
+{
+  char *p = buf, *end = buf + n - 1;
+
+  while (p < end && (p = memchr (p, '\r', end - p)) != 0)
+    {
+      if (p[1] == '\n')
+	return p;
+      p++;
+    }
+  return 0;
+}
+
+/* Parse a multipart/form-data body (RFC 2388) as it is read. File
+ * contents are passed through to the field a buffer at a time,
+ * keeping back only enough to recognise a delimiter split across
+ * two reads.
+ */
+static int
+read_multipart (cgi c, http_request h, io_handle io, pool tmp,
+		const char *content_type)
+{
+  enum { preamble, delimiter, headers, body, epilogue } state = preamble;
+  const char *boundary;
+  char *delim, *buf, *line, *eol, *name = 0, *filename = 0;
+  struct buffer value = { 0, 0, 0 };
+  struct field f;
+  int len, n, p, d, r, total = 0;
+
+  boundary = get_header_param (tmp, content_type, "boundary");
+  if (!boundary || boundary[0] == '\0' || strlen (boundary) > 70)
+    return -1;
+  delim = psprintf (tmp, "\r\n--%s", boundary);
+  len = strlen (delim);
+
+  buf = pmalloc (tmp, BUFFER_SIZE);
+  f.fd = -1;
+
+  /* The first delimiter needn't be preceded by CRLF, so pretend it is. */
+  memcpy (buf, "\r\n", 2);
+  n = 2;
+
+  while ((r = read_post (h, io, buf + n, BUFFER_SIZE - n, &total)) > 0)
+    {
+      n += r;
+      p = 0;
+
+      while (p < n)
+	{
+	  if (state == preamble || state == body)
+	    {
+	      d = find_delimiter (buf + p, n - p, delim, len);
+	      if (d == -1)
+		{
+		  /* Keep enough to match a delimiter which has been split. */
+		  d = n - p - (len - 1);
+		  if (d <= 0) break;
+		  if (state == body && field_write (tmp, &f, buf + p, d) == -1)
+		    goto error;
+		  p += d;
+		  break;
+		}
+
+	      if (state == body)
+		{
+		  if (field_write (tmp, &f, buf + p, d) == -1)
+		    goto error;
+		  end_field (&f);
+		}
+	      p += d + len;
+	      state = delimiter;
+	    }
+	  else if (state == epilogue)
+	    p = n;
+	  else
+	    {
+	      /* The final delimiter is followed by "--". */
+	      if (state == delimiter)
+		{
+		  if (n - p < 2) break;
+		  if (buf[p] == '-' && buf[p+1] == '-')
+		    {
+		      state = epilogue;
+		      continue;
+		    }
+		}
+
+	      eol = find_crlf (buf + p, n - p);
+	      if (!eol) break;
+	      *eol = '\0';
+	      line = buf + p;
+	      p = eol + 2 - buf;
+
+	      if (state == delimiter)
+		{
+		  state = headers;
+		  name = filename = 0;
+		}
+	      else if (line[0] == '\0') /* End of headers. */
+		{
+		  if (!name) goto error;
+		  start_field (c, &f, &value, name, filename);
+		  state = body;
+		}
+	      else if (strncasecmp (line, "Content-Disposition:", 20) == 0)
+		{
+		  name = get_header_param (c->pool, line + 20, "name");
+		  filename = get_header_param (c->pool, line + 20, "filename");
+		}
+	    }
+	}
+
+      memmove (buf, buf + p, n - p);
+      n -= p;
+      if (n == BUFFER_SIZE)
+	goto error;		/* Header line too long. */
+    }
+  if (r == -1 || state != epilogue)
+    goto error;			/* Error, or body was truncated. */
+
+  return 0;
+
+ error:
+  if (state == body) abort_field (&f);
+  return -1;
 }
 
 static void
@@ -146,7 +618,6 @@ parse_qs (cgi c, const char *qs)
 {
   vector v;
   int i;
-  static char *one = "1";
 
   if (qs && qs[0] != '\0')
     {
@@ -165,7 +636,7 @@ parse_qs (cgi c, const char *qs)
 
 	  /* Split the string on the '=' character and set name and value. */
 	  *t = '\0';
-	  insert_param (c, param, t+1);
+	  insert_param (c, param, cgi_unescape (c->pool, t+1));
 	}
     }
 }
@@ -174,13 +645,11 @@ static void
 insert_param (cgi c, char *name, char *value)
 {
   vector v;
-  char *s;
 
   if (!shash_get (c->params, name, v))
     v = new_vector (c->pool, char *);
 
-  s = cgi_unescape (c->pool, value);
-  vector_push_back (v, s);
+  vector_push_back (v, value);
   shash_insert (c->params, name, v);
 }
 
@@ -203,6 +672,17 @@ cgi_param (cgi c, const char *name)
   return s;
 }
 
+const char *
+cgi_param_file (cgi c, const char *name)
+{
+  char *path;
+
+  if (!shash_get (c->files, name, path))
+    return 0;
+
+  return path;
+}
+
 const vector
 cgi_param_list (cgi c, const char *name)
 {
@@ -217,6 +697,7 @@ cgi_param_list (cgi c, const char *name)
 int
 cgi_erase (cgi c, const char *name)
 {
+  shash_erase (c->files, name);
   return shash_erase (c->params, name);
 }
 
@@ -231,6 +712,7 @@ copy_cgi (pool npool, cgi c)
 
   nc->pool = npool;
   nc->params = new_shash (npool, vector);
+  nc->files = new_shash (npool, char *);
 
   keys = shash_keys_in_pool (c->params, npool);
 
@@ -250,6 +732,12 @@ copy_cgi (pool npool, cgi c)
 	  vector_push_back (v, value);
 	  shash_insert (nc->params, key, v);
 	}
+
+      if (shash_get (c->files, key, value))
+	{
+	  value = pstrdup (npool, value);
+	  shash_insert (nc->files, key, value);
+	}
     }
 
   return nc;
@@ -299,15 +787,6 @@ cgi_escape (pool pool, const char *str)
   return new_str;
 }
 
-static inline int
-hex_to_int (char c)
-{
-  if (c >= '0' && c <= '9') return c - '0';
-  else if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-  else if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-  else return -1;
-}
-
 char *
 cgi_unescape (pool pool, const char *str)
 {
@@ -39,15 +39,32 @@ typedef struct cgi *cgi;
  * default is -1 (unlimited) which can leave the server open to denial
  * of service attacks.
  *
- * See also: @ref{new_cgi(3)}.
+ * See also: @ref{new_cgi(3)}, @ref{cgi_get_spill_size(3)}.
  */
 extern int cgi_get_post_max (void);
 extern int cgi_set_post_max (int new_post_max);
 
+/* Function: cgi_get_spill_size - Get and set the size of uploaded files kept in memory.
+ * Function: cgi_set_spill_size
+ *
+ * Files uploaded in a @code{multipart/form-data} POST (that is,
+ * fields which have a filename) larger than this many bytes
+ * (default: 64K) are written to a temporary file rather than being
+ * kept in memory, so that large uploads can be handled. Other fields
+ * are always kept in memory (see @ref{cgi_get_post_max(3)}). The
+ * temporary file is created in @code{$TMPDIR} (or @code{/tmp}), and
+ * is deleted when the pool passed to @ref{new_cgi(3)} is deleted.
+ *
+ * See also: @ref{cgi_param_file(3)}, @ref{cgi_get_post_max(3)}.
+ */
+extern int cgi_get_spill_size (void);
+extern int cgi_set_spill_size (int new_spill_size);
+
 /* Function: new_cgi - Library for parsing CGI query strings.
  * Function: cgi_params
  * Function: cgi_param
  * Function: cgi_param_list
+ * Function: cgi_param_file
  * Function: cgi_erase
  * Function: copy_cgi
  *
@@ -58,6 +75,15 @@ extern int cgi_set_post_max (int new_post_max);
  * values are automatically unescaped by the library before you
  * get to see them.
  *
+ * POSTed parameters may be sent either as
+ * @code{application/x-www-form-urlencoded} or as
+ * @code{multipart/form-data} (as used for file uploads). The body
+ * is parsed as it is read (see @ref{http_request_read_body(3)}),
+ * so uploads use a bounded amount of memory. @code{new_cgi}
+ * returns @code{NULL} if the body is malformed, too long (see
+ * @ref{cgi_get_post_max(3)}), or contains a parameter name longer
+ * than 1024 bytes.
+ *
  * @code{cgi_params} returns a list of all the names of the parameters passed
  * to the script. The list is returned as a @code{vector} of
  * @code{char *}.
@@ -71,6 +97,13 @@ extern int cgi_set_post_max (int new_post_max);
  * CGI parameter. The list is returned as a @code{vector} of
  * @code{char *}.
  *
+ * @code{cgi_param_file} returns the name of the temporary file
+ * holding the value of the named parameter, if it was an uploaded
+ * file too large to keep in memory (see @ref{cgi_get_spill_size(3)}), or
+ * @code{NULL} otherwise. In this case @code{cgi_param} returns the
+ * filename which the browser sent (or @code{""}) instead of the
+ * value itself.
+ *
  * @code{cgi_erase} erases the named parameter. If a parameter
  * was erased, this returns true, else this returns false.
  *
@@ -83,6 +116,7 @@ extern cgi new_cgi (pool, http_request, io_handle);
 extern vector cgi_params (cgi);
 extern const char *cgi_param (cgi, const char *name);
 extern const vector cgi_param_list (cgi, const char *name);
+extern const char *cgi_param_file (cgi, const char *name);
 extern int cgi_erase (cgi, const char *name);
 extern cgi copy_cgi (pool, cgi);
 
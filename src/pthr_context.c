@@ -23,9 +23,197 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
 #include "pthr_context.h"
 
-#ifdef HAVE_WORKING_SETCONTEXT
+#ifdef HAVE_ASM_CONTEXT
+
+/* The context switch saves the callee-saved registers on the old
+ * stack, stores the old stack pointer, loads the new stack pointer
+ * and pops the registers saved there. Registers which the ABI says
+ * the caller must save are already saved by the C compiler around
+ * the call to _pth_mctx_switch, so there is nothing else to do.
+ *
+ * A new context is given a stack which looks as if it had been
+ * switched out, with _pth_mctx_start as the return address. That
+ * calls the thread function, whose address and argument it finds
+ * in two of the callee-saved registers.
+ */
+
+#define MCTX_STR2(x) #x
+#define MCTX_STR(x) MCTX_STR2(x)
+#define MCTX_SYM(name) MCTX_STR(__USER_LABEL_PREFIX__) #name
+
+#ifdef __ELF__
+#define MCTX_FUNCTION(name)				\
+  ".globl " MCTX_SYM(name) "\n"				\
+  ".type " MCTX_SYM(name) ", %function\n"		\
+  MCTX_SYM(name) ":\n"
+#define MCTX_ABORT MCTX_SYM(abort) "@PLT"
+#else
+#define MCTX_FUNCTION(name)				\
+  ".globl " MCTX_SYM(name) "\n"				\
+  MCTX_SYM(name) ":\n"
+#define MCTX_ABORT MCTX_SYM(abort)
+#endif
+
+extern void _pth_mctx_start (void);
+
+#if defined(__x86_64__)
+
+/* Frame: mxcsr and x87 control word, r15, r14, r13, r12, rbx, rbp,
+ * return address.
+ */
+#define MCTX_FRAME_WORDS 8
+#define MCTX_FRAME_PC 7
+
+__asm__ (".text\n"
+	 ".p2align 4\n"
+	 MCTX_FUNCTION(_pth_mctx_switch)
+	 "pushq %rbp\n"
+	 "pushq %rbx\n"
+	 "pushq %r12\n"
+	 "pushq %r13\n"
+	 "pushq %r14\n"
+	 "pushq %r15\n"
+	 "subq $8, %rsp\n"
+	 "stmxcsr (%rsp)\n"
+	 "fnstcw 4(%rsp)\n"
+	 "movq %rsp, (%rdi)\n"
+	 "movq %rsi, %rsp\n"
+	 "1:\n"
+	 "ldmxcsr (%rsp)\n"
+	 "fldcw 4(%rsp)\n"
+	 "addq $8, %rsp\n"
+	 "popq %r15\n"
+	 "popq %r14\n"
+	 "popq %r13\n"
+	 "popq %r12\n"
+	 "popq %rbx\n"
+	 "popq %rbp\n"
+	 "ret\n"
+	 ".p2align 4\n"
+	 MCTX_FUNCTION(_pth_mctx_restore)
+	 "movq %rdi, %rsp\n"
+	 "jmp 1b\n"
+	 ".p2align 4\n"
+	 MCTX_FUNCTION(_pth_mctx_start)
+	 "movq %r13, %rdi\n"
+	 "callq *%r12\n"
+	 "callq " MCTX_ABORT "\n");
+
+void
+mctx_set (mctx_t *mctx,
+	  void (*sf_addr) (void *), void *sf_arg,
+	  void *sk_addr, int sk_size)
+{
+  unsigned long top = ((unsigned long) sk_addr + sk_size) & ~15UL;
+  void **sp;
+
+  /* After the final "ret" the stack pointer must be 16-byte aligned,
+   * as if _pth_mctx_start had been called normally and then pushed
+   * the frame pointer.
+   */
+  sp = (void **) (top - 16) - MCTX_FRAME_WORDS;
+  memset (sp, 0, (MCTX_FRAME_WORDS + 2) * sizeof (void *));
+  *(unsigned int *) &sp[0] = 0x1f80;	       /* Default mxcsr. */
+  *((unsigned short *) &sp[0] + 2) = 0x037f; /* Default x87 control word. */
+  sp[3] = sf_arg;			/* r13 */
+  sp[4] = sf_addr;			/* r12 */
+  sp[MCTX_FRAME_PC] = _pth_mctx_start;
+
+  mctx->sp = sp;
+}
+
+#elif defined(__aarch64__)
+
+/* Frame: x19-x28, x29 (frame pointer), x30 (link register), d8-d15,
+ * fpcr, padding.
+ */
+#define MCTX_FRAME_WORDS 22
+#define MCTX_FRAME_PC 11
+
+__asm__ (".text\n"
+	 ".p2align 4\n"
+	 MCTX_FUNCTION(_pth_mctx_switch)
+	 "sub sp, sp, #176\n"
+	 "stp x19, x20, [sp, #0]\n"
+	 "stp x21, x22, [sp, #16]\n"
+	 "stp x23, x24, [sp, #32]\n"
+	 "stp x25, x26, [sp, #48]\n"
+	 "stp x27, x28, [sp, #64]\n"
+	 "stp x29, x30, [sp, #80]\n"
+	 "stp d8, d9, [sp, #96]\n"
+	 "stp d10, d11, [sp, #112]\n"
+	 "stp d12, d13, [sp, #128]\n"
+	 "stp d14, d15, [sp, #144]\n"
+	 "mrs x9, fpcr\n"
+	 "str x9, [sp, #160]\n"
+	 "mov x9, sp\n"
+	 "str x9, [x0]\n"
+	 "mov sp, x1\n"
+	 "1:\n"
+	 "ldr x9, [sp, #160]\n"
+	 "msr fpcr, x9\n"
+	 "ldp x19, x20, [sp, #0]\n"
+	 "ldp x21, x22, [sp, #16]\n"
+	 "ldp x23, x24, [sp, #32]\n"
+	 "ldp x25, x26, [sp, #48]\n"
+	 "ldp x27, x28, [sp, #64]\n"
+	 "ldp x29, x30, [sp, #80]\n"
+	 "ldp d8, d9, [sp, #96]\n"
+	 "ldp d10, d11, [sp, #112]\n"
+	 "ldp d12, d13, [sp, #128]\n"
+	 "ldp d14, d15, [sp, #144]\n"
+	 "add sp, sp, #176\n"
+	 "ret\n"
+	 ".p2align 4\n"
+	 MCTX_FUNCTION(_pth_mctx_restore)
+	 "mov sp, x0\n"
+	 "b 1b\n"
+	 ".p2align 4\n"
+	 MCTX_FUNCTION(_pth_mctx_start)
+	 "mov x0, x20\n"
+	 "blr x19\n"
+	 "bl " MCTX_SYM(abort) "\n");
+
+void
+mctx_set (mctx_t *mctx,
+	  void (*sf_addr) (void *), void *sf_arg,
+	  void *sk_addr, int sk_size)
+{
+  unsigned long top = ((unsigned long) sk_addr + sk_size) & ~15UL;
+  void **sp;
+
+  sp = (void **) top - MCTX_FRAME_WORDS;
+  memset (sp, 0, MCTX_FRAME_WORDS * sizeof (void *));
+  sp[0] = sf_addr;			/* x19 */
+  sp[1] = sf_arg;			/* x20 */
+  sp[MCTX_FRAME_PC] = _pth_mctx_start;	/* x30 */
+
+  mctx->sp = sp;
+}
+
+#else
+#error "HAVE_ASM_CONTEXT defined, but no context switch for this architecture - see conf/test_asmcontext.c"
+#endif
+
+unsigned long
+mctx_get_PC (mctx_t *mctx)
+{
+  return (unsigned long) ((void **) mctx->sp)[MCTX_FRAME_PC];
+}
+
+unsigned long
+mctx_get_SP (mctx_t *mctx)
+{
+  return (unsigned long) mctx->sp;
+}
+
+#elif defined(HAVE_WORKING_SETCONTEXT)
 
 void
 mctx_set (mctx_t *mctx,
@@ -47,7 +235,8 @@ mctx_set (mctx_t *mctx,
   mctx->uc.uc_stack.ss_sp = sk_addr + sk_size - 8;
   mctx->uc.uc_stack.ss_size = sk_size - 8;
 #else
-#error "Unsupported architecture"
+  mctx->uc.uc_stack.ss_sp = sk_addr;
+  mctx->uc.uc_stack.ss_size = sk_size;
 #endif
   mctx->uc.uc_stack.ss_flags = 0;
 
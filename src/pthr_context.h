@@ -23,7 +23,28 @@
 
 #include <setjmp.h>
 
-#ifdef HAVE_WORKING_SETCONTEXT
+#ifdef HAVE_ASM_CONTEXT
+
+/* Hand-written context switch (see pthr_context.c). This only saves
+ * and restores the callee-saved registers and the stack pointer, and
+ * unlike swapcontext does not make a system call to save and restore
+ * the signal mask.
+ */
+typedef struct mctx_st {
+  void *sp;
+} mctx_t;
+
+extern void _pth_mctx_switch (void **old_sp, void *new_sp);
+extern void _pth_mctx_restore (void *new_sp) __attribute__((noreturn));
+
+/* Restore machine context. */
+#define mctx_restore(mctx) _pth_mctx_restore ((mctx)->sp)
+
+/* Switch machine context. */
+#define mctx_switch(mctx_old, mctx_new) \
+_pth_mctx_switch (&((mctx_old)->sp), (mctx_new)->sp)
+
+#elif defined(HAVE_WORKING_SETCONTEXT)
 
 #include <ucontext.h>
 
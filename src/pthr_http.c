@@ -24,6 +24,23 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <limits.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
 
 #ifdef HAVE_SETJMP_H
 #include <setjmp.h>
@@ -41,16 +58,8 @@
 #include <time.h>
 #endif
 
-#ifdef HAVE_SYS_SOCKET_H
-#include <sys/socket.h>
-#endif
-
-#ifdef HAVE_NETINET_IN_H
-#include <netinet/in.h>
-#endif
-
-#ifdef HAVE_ARPA_INET_H
-#include <arpa/inet.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
 #endif
 
 #ifdef HAVE_ALLOCA_H
@@ -64,20 +73,104 @@
 #include <pre.h>
 
 #include "pthr_reactor.h"
+#include "pthr_pseudothread.h"
 #include "pthr_iolib.h"
 #include "pthr_cgi.h"
 #include "pthr_http.h"
 
 #define MAX_LINE_LENGTH 4096
+#define NR_COMMON_HEADERS 15
+#define COMMON_INDEX_SIZE 64	/* Size of common header hash table. */
+#define MAX_HEADERS 100		/* Max headers in a request. */
+#define HEADER_BLOCK_SIZE 8192	/* Initial size of header block. */
+#define ARENA_CHUNK_SIZE 4096	/* Minimum size of arena chunks. */
+#define ARENA_ALIGN 16		/* Alignment of arena allocations. */
 #define CRLF "\r\n"
 
+#ifndef PIPE_BUF
+#define PIPE_BUF 512
+#endif
+
+#define LOG_RING_SIZE (256 * 1024) /* Default size of async log ring. */
+#define LOG_FLUSH_INTERVAL 1000	/* Default async log flush interval (ms). */
+#define LOG_FLUSH_SIZE (16 * 1024) /* Default async log flush size. */
+#define LOG_MAX_STRINGS 4096	/* Max strings remembered in binary logs. */
+#define LOG_MAX_STRING_LEN (PIPE_BUF / 4) /* Longest string in binary logs. */
+#define LOG_MAX_WRITERS 64	/* Max processes tracked by log writer. */
+#define LOG_ROTATE 255		/* Type of binary log rotation marker. */
+
 static const char *servername = PACKAGE "-httpd/" VERSION;
 static FILE *log_fp = 0;
+static int log_format = HTTP_LOG_FORMAT_TEXT;
+
+/* The Server and Date headers are the same for every response sent
+ * in the same second, so we format them once and keep them here.
+ * The block contains "Server: ...\r\nDate: ...\r\n", and date_offset
+ * is where the Date header starts. The time string used in the log
+ * file is cached in the same way.
+ */
+static struct
+{
+  time_t t;			/* Time of the cached Date header. */
+  const char *servername;	/* Server name in the cached header. */
+  char *block;			/* Preformatted headers. */
+  int block_size;		/* Allocated size of block. */
+  int len;			/* Length of headers in block. */
+  int date_offset;		/* Offset of Date header in block. */
+  time_t log_t;			/* Time of the cached log time string. */
+  char log_time[32];		/* Log time string. */
+} header_cache = { -1, 0, 0, 0, 0, 0, -1 };
+
+/* Asynchronous logging. Log records are appended to a ring buffer.
+ * A pseudothread copies them in batches down a non-blocking pipe to
+ * a child process, and only the child process writes to the log file,
+ * so a slow disk never holds up the reactor.
+ */
+static struct
+{
+  pid_t pid;			/* Log writer process, or 0 if not running. */
+  int fd;			/* Pipe to the log writer process. */
+  char *ring;			/* Ring buffer of log records. */
+  int size;			/* Size of ring buffer. */
+  int tail;			/* Offset of first unwritten byte. */
+  int used;			/* Number of unwritten bytes. */
+  int flush_interval;		/* Flush at least this often (ms). */
+  int flush_size;		/* Flush when this many bytes are waiting. */
+  unsigned long drops;		/* Number of records dropped. */
+  int writing;			/* Writer thread is waiting in write. */
+  int running;			/* Writer thread is running. */
+  reactor_timer timer;		/* Flush timer, if set. */
+  int binary;			/* Ring contains binary log records. */
+} async_log;
+
+/* In the binary log format, strings (URLs, user agents and so on) are
+ * written out once, and after that referred to by number. This table
+ * maps the strings we have written to their numbers. It is cleared
+ * when the log file is rotated, and when it gets too big.
+ */
+static struct
+{
+  pool pool;			/* Pool for the table, or NULL. */
+  shash ids;			/* Map of string -> id. */
+  int nr;			/* Number of strings in the table. */
+  unsigned next_id;		/* Next id to hand out. */
+  unsigned pid;			/* Our process ID. */
+} log_strings;
+
+static volatile sig_atomic_t log_strings_stale = 0;
+
+/* Set on SIGHUP. A rotation marker is put in the ring before the next
+ * log record, so that the log writer process knows exactly which
+ * records belong in the old log file and which in the new one.
+ */
+static volatile sig_atomic_t log_rotate_pending = 0;
 
 struct http_request
 {
   pool pool;			/* Pool for memory allocations. */
+  http_arena arena;		/* Arena, or NULL if not using one. */
   time_t t;			/* Request time. */
+  reactor_time_t start;		/* When the request line arrived (ms). */
   int method;			/* Method. */
   const char *original_url;	/* Original request URL (used for logging). */
   const char *url;		/* The URL. */
@@ -85,7 +178,87 @@ struct http_request
   const char *query_string;	/* Query string only. */
   int is_http09;		/* Is it an HTTP/0.9 request? */
   int major, minor;		/* Major/minor version numbers. */
-  sash headers;			/* Headers. */
+  int body_state;		/* State of the request body reader. */
+#define BODY_START   0		/* Haven't started reading the body. */
+#define BODY_LENGTH  1		/* Reading body_left bytes. */
+#define BODY_CHUNKED 2		/* Reading chunk with body_left bytes left. */
+#define BODY_EOF     3		/* Reading until end of file. */
+#define BODY_DONE    4		/* Read all of the body. */
+  long long body_left;		/* Bytes left in body or current chunk. */
+
+  /* The request line and headers are read into a single block, and
+   * parsed in place. Keys are lowercased. If a header is repeated,
+   * only the last value is kept.
+   */
+  char *block;			/* Request line and headers. */
+  int block_size;		/* Allocated size of block. */
+  int block_used;		/* Number of bytes used. */
+  struct http_header *headers;	/* Headers (pointing into block). */
+  int nr_headers;		/* Number of headers. */
+  const char *common[NR_COMMON_HEADERS]; /* Values of common headers. */
+
+  /* Hash table of headers. Each entry is 1 + the index of a header
+   * in headers, or 0 if the entry is empty.
+   */
+  unsigned char *index;
+  unsigned index_mask;		/* Size of index - 1. */
+};
+
+/* Common headers, which are looked up in a table rather than by
+ * searching through all the headers.
+ */
+static const struct common_header
+{
+  const char *key;
+  int len;
+} common_headers[NR_COMMON_HEADERS] = {
+#define COMMON_HEADER(key) { key, sizeof key - 1 }
+  COMMON_HEADER ("accept"),
+  COMMON_HEADER ("accept-encoding"),
+  COMMON_HEADER ("accept-language"),
+  COMMON_HEADER ("authorization"),
+  COMMON_HEADER ("connection"),
+  COMMON_HEADER ("content-length"),
+  COMMON_HEADER ("content-type"),
+  COMMON_HEADER ("cookie"),
+  COMMON_HEADER ("expect"),
+  COMMON_HEADER ("host"),
+  COMMON_HEADER ("if-modified-since"),
+  COMMON_HEADER ("range"),
+  COMMON_HEADER ("referer"),
+  COMMON_HEADER ("transfer-encoding"),
+  COMMON_HEADER ("user-agent"),
+#undef COMMON_HEADER
+};
+
+/* Hash table of common headers: 1 + the index in common_headers, or 0. */
+static unsigned char common_index[COMMON_INDEX_SIZE];
+
+/* An arena is a list of chunks from which we allocate memory simply
+ * by bumping a pointer. At the end of each request the chunks are
+ * kept and the pointers are reset, so a long-lived connection reuses
+ * the same memory over and over.
+ */
+struct arena_chunk
+{
+  struct arena_chunk *next;
+  size_t size;			/* Size of data. */
+  size_t used;			/* Bytes of data used. */
+  char *data;
+};
+
+struct http_arena
+{
+  pool pool;			/* Long-lived (connection) pool. */
+  pool request_pool;		/* Per-request subpool, created on demand. */
+  struct arena_chunk *chunks;	/* List of chunks. */
+  struct arena_chunk *current;	/* Chunk we are allocating from. */
+
+  /* These buffers used when parsing requests are reused too. */
+  char *block;
+  int block_size;
+  int *offsets;
+  int max_offsets;
 };
 
 struct http_response
@@ -102,12 +275,33 @@ struct http_response
 #define _HTTP_XH_CONTENT_LENGTH  16
 #define _HTTP_XH_TRANSFER_ENCODING_CHUNKED 32
   int content_length;		/* Content length (if seen). */
+
+  /* Small chunks are collected here and sent as one chunk. */
+  char *chunk_buf;		/* Buffer, or NULL if not coalescing. */
+  int chunk_used;		/* Bytes in the buffer. */
+  int chunk_threshold;		/* Size of the buffer. */
 };
 
 #define _HTTP_XH_LENGTH_DEFINED (_HTTP_XH_CONTENT_LENGTH|_HTTP_XH_TRANSFER_ENCODING_CHUNKED)
 
+static http_request read_request (http_request h, io_handle io);
+static void *request_alloc (http_request h, size_t n);
 static void parse_url (http_request h);
+static int read_line (http_request h, io_handle io);
+static void add_header (http_request h, char *key, const char *value);
+static unsigned hash_header (const char *key, int len);
+static int lookup_common_header (const char *key, int len, unsigned hash);
+static void init_common_index (void) __attribute__ ((constructor));
+static void update_header_cache (time_t t);
 static void do_logging (http_response h);
+static void send_chunk (http_response h, const char *data, int length);
+static int append_async_log (const char *record, int len);
+static int put_async_log (const char *record, int len);
+static void queue_log_rotation (void);
+static int write_log_record (const void *record, int len);
+static int log_string (const char *str, unsigned *id);
+static int write_async_log (int wait);
+static void start_log_writer (void);
 
 const char *
 http_get_servername (void)
@@ -121,28 +315,142 @@ http_set_servername (const char *new_server_name)
   return servername = new_server_name;
 }
 
+http_arena
+new_http_arena (pool pool)
+{
+  http_arena a = pmalloc (pool, sizeof *a);
+
+  memset (a, 0, sizeof *a);
+  a->pool = pool;
+  a->block_size = HEADER_BLOCK_SIZE;
+  a->block = pmalloc (pool, a->block_size);
+  a->max_offsets = 32;
+  a->offsets = pmalloc (pool, a->max_offsets * sizeof (int));
+
+  return a;
+}
+
+void *
+http_arena_alloc (http_arena a, size_t n)
+{
+  struct arena_chunk *c, *last = 0;
+  void *ptr;
+
+  n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  /* Find a chunk with enough space, starting from the current one. */
+  for (c = a->current; c; last = c, c = c->next)
+    if (c->size - c->used >= n)
+      break;
+
+  if (c == 0)
+    {
+      c = pmalloc (a->pool, sizeof *c);
+      c->next = 0;
+      c->size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+      c->used = 0;
+      c->data = pmalloc (a->pool, c->size);
+      if (last) last->next = c;
+      else a->chunks = c;
+    }
+
+  a->current = c;
+  ptr = c->data + c->used;
+  c->used += n;
+  return ptr;
+}
+
+pool
+http_arena_pool (http_arena a)
+{
+  if (a->request_pool == 0)
+    a->request_pool = new_subpool (a->pool);
+  return a->request_pool;
+}
+
 http_request
-new_http_request (pool pool, io_handle io)
+http_request_begin (http_arena a, io_handle io)
+{
+  http_request h = http_arena_alloc (a, sizeof *h);
+
+  memset (h, 0, sizeof *h);
+  h->arena = a;
+  h->block = a->block;
+  h->block_size = a->block_size;
+
+  return read_request (h, io);
+}
+
+void
+http_request_end (http_arena a)
 {
-  char line[MAX_LINE_LENGTH];
-  char *start_url, *end_url, *end_key;
-  char *key, *value;
+  struct arena_chunk *c;
 
+  if (a->request_pool)
+    {
+      delete_pool (a->request_pool);
+      a->request_pool = 0;
+    }
+
+  for (c = a->chunks; c; c = c->next)
+    c->used = 0;
+  a->current = a->chunks;
+}
+
+http_request
+new_http_request (pool pool, io_handle io)
+{
   http_request h = pmalloc (pool, sizeof *h);
 
   memset (h, 0, sizeof *h);
   h->pool = pool;
-  h->headers = new_sash (h->pool);
+  h->block_size = HEADER_BLOCK_SIZE;
+  h->block = pmalloc (pool, h->block_size);
+
+  return read_request (h, io);
+}
+
+/* Allocate memory for the lifetime of the request. */
+static void *
+request_alloc (http_request h, size_t n)
+{
+  if (h->arena)
+    return http_arena_alloc (h->arena, n);
+  else
+    return pmalloc (h->pool, n);
+}
+
+/* Return the pool for the request, creating it if necessary. */
+static pool
+request_pool (http_request h)
+{
+  if (h->arena)
+    return http_arena_pool (h->arena);
+  else
+    return h->pool;
+}
+
+static http_request
+read_request (http_request h, io_handle io)
+{
+  char *line, *start_url, *end_url, *end_key;
+  int offset, url_offset, i, nr_offsets = 0, max_offsets;
+  int *offsets;
+
   h->t = reactor_time / 1000;
+  h->body_state = BODY_START;
 
   /* Read the first line of the request. As a sop to Netscape 4, ignore
    * blank lines (see note below about Netscape generating extra CRLFs
    * after POST requests).
    */
  again:
-  if (!io_fgets (line, sizeof line, io, 0))
+  h->block_used = 0;
+  if (read_line (h, io) == -1)
     return 0;
+  line = h->block;
   if (line[0] == '\0') goto again;
+  h->start = reactor_time;
 
   /* Previous versions of the server supported only GET requests. We
    * now support GET and HEAD (as required by RFC 2616 section 5.1.1)
@@ -183,7 +491,7 @@ new_http_request (pool pool, io_handle io)
   if (end_url == 0)
     {
       /* It's an HTTP/0.9 request! */
-      h->original_url = h->url = pstrdup (h->pool, start_url);
+      h->original_url = h->url = start_url;
       parse_url (h);
       h->is_http09 = 1;
       h->major = 0;
@@ -194,8 +502,7 @@ new_http_request (pool pool, io_handle io)
 
   /* It's an HTTP > 0.9 request, so there must be headers following. */
   *end_url = '\0';
-  h->original_url = h->url = pstrdup (h->pool, start_url);
-  parse_url (h);
+  url_offset = start_url - h->block;
 
   /* Check HTTP version number. */
   if (strncmp (end_url+1, "HTTP/", 5) != 0 ||
@@ -214,10 +521,24 @@ new_http_request (pool pool, io_handle io)
   h->major = *(end_url+6) - '0';
   h->minor = *(end_url+8) - '0';
 
+  /* The block may be moved while reading headers, so we remember
+   * where the keys and values are as offsets into it.
+   */
+  if (h->arena)
+    {
+      offsets = h->arena->offsets;
+      max_offsets = h->arena->max_offsets;
+    }
+  else
+    {
+      max_offsets = 32;
+      offsets = pmalloc (h->pool, max_offsets * sizeof (int));
+    }
+
   /* Read the headers. */
   for (;;)
     {
-      if (!io_fgets (line, sizeof line, io, 0))
+      if ((offset = read_line (h, io)) == -1)
 	{
 	  const char *msg = "unexpected EOF reading headers";
 
@@ -227,6 +548,7 @@ new_http_request (pool pool, io_handle io)
 	}
 
       /* End of headers? */
+      line = h->block + offset;
       if (line[0] == '\0')
 	break;
 
@@ -241,7 +563,7 @@ new_http_request (pool pool, io_handle io)
 	  pth_die (msg);
 	}
 
-      /* Split up the key and value and store them. */
+      /* Split up the key and value. */
       *end_key = '\0';
 
       /* Find the beginning of the value field.
@@ -252,18 +574,160 @@ new_http_request (pool pool, io_handle io)
       end_key++;
       ptrim (end_key);
 
-      key = pstrdup (h->pool, line);
-      value = pstrdup (h->pool, end_key);
-
       /* Canonicalize the key (HTTP header keys are case insensitive). */
-      pstrlwr (key);
+      pstrlwr (line);
 
-      sash_insert (h->headers, key, value);
+      if (nr_offsets == 2 * MAX_HEADERS)
+	{
+	  const char *msg = "too many headers in request";
+
+	  syslog (LOG_INFO, msg);
+	  io_fputs ("HTTP/1.1 431 Request header fields too large" CRLF, io);
+	  pth_die (msg);
+	}
+
+      if (nr_offsets == max_offsets)
+	{
+	  max_offsets *= 2;
+	  if (h->arena)
+	    {
+	      offsets = prealloc (h->arena->pool, offsets,
+				  max_offsets * sizeof (int));
+	      h->arena->offsets = offsets;
+	      h->arena->max_offsets = max_offsets;
+	    }
+	  else
+	    offsets = prealloc (h->pool, offsets, max_offsets * sizeof (int));
+	}
+      offsets[nr_offsets++] = offset;
+      offsets[nr_offsets++] = end_key - h->block;
     }
 
+  /* The block won't move now, so we can point into it. */
+  h->original_url = h->url = h->block + url_offset;
+  parse_url (h);
+
+  h->headers = request_alloc (h,
+			      (nr_offsets / 2) * sizeof (struct http_header));
+
+  /* Keep the hash table no more than half full. */
+  for (i = 8; i < nr_offsets; i *= 2)
+    ;
+  h->index = request_alloc (h, i);
+  memset (h->index, 0, i);
+  h->index_mask = i - 1;
+
+  for (i = 0; i < nr_offsets; i += 2)
+    add_header (h, h->block + offsets[i], h->block + offsets[i+1]);
+
   return h;
 }
 
+/* Read the next line of the request into the block, growing it if
+ * necessary. Returns the offset of the line in the block, or -1 on EOF.
+ */
+static int
+read_line (http_request h, io_handle io)
+{
+  int offset = h->block_used;
+
+  if (h->block_size - h->block_used < MAX_LINE_LENGTH)
+    {
+      h->block_size *= 2;
+      if (h->arena)
+	{
+	  h->block = prealloc (h->arena->pool, h->block, h->block_size);
+	  h->arena->block = h->block;
+	  h->arena->block_size = h->block_size;
+	}
+      else
+	h->block = prealloc (h->pool, h->block, h->block_size);
+    }
+
+  if (!io_fgets (h->block + offset, MAX_LINE_LENGTH, io, 0))
+    return -1;
+
+  h->block_used += strlen (h->block + offset) + 1;
+  return offset;
+}
+
+/* Add a header to the list. If the key has been seen before, then the
+ * later value replaces the earlier one.
+ */
+static void
+add_header (http_request h, char *key, const char *value)
+{
+  int len = strlen (key), c, i;
+  unsigned hash = hash_header (key, len), slot;
+
+  c = lookup_common_header (key, len, hash);
+  if (c >= 0) h->common[c] = value;
+
+  for (slot = hash & h->index_mask;
+       (i = h->index[slot]) != 0;
+       slot = (slot + 1) & h->index_mask)
+    if (strcmp (h->headers[i-1].key, key) == 0)
+      {
+	h->headers[i-1].value = value;
+	return;
+      }
+
+  h->headers[h->nr_headers].key = key;
+  h->headers[h->nr_headers].value = value;
+  h->nr_headers++;
+  h->index[slot] = h->nr_headers;
+}
+
+/* Case insensitive hash of a header key (FNV-1a). */
+static unsigned
+hash_header (const char *key, int len)
+{
+  unsigned hash = 2166136261U;
+  int i;
+
+  for (i = 0; i < len; ++i)
+    {
+      hash ^= tolower ((unsigned char) key[i]);
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+/* Return the index of key in the common headers table, or -1 if
+ * it's not a common header. The comparison is case insensitive.
+ */
+static int
+lookup_common_header (const char *key, int len, unsigned hash)
+{
+  unsigned slot;
+  int c;
+
+  for (slot = hash & (COMMON_INDEX_SIZE - 1);
+       (c = common_index[slot]) != 0;
+       slot = (slot + 1) & (COMMON_INDEX_SIZE - 1))
+    if (common_headers[c-1].len == len &&
+	strncasecmp (common_headers[c-1].key, key, len) == 0)
+      return c-1;
+  return -1;
+}
+
+static void
+init_common_index (void)
+{
+  unsigned slot;
+  int c;
+
+  for (c = 0; c < NR_COMMON_HEADERS; ++c)
+    {
+      slot = hash_header (common_headers[c].key, common_headers[c].len);
+      for (slot &= COMMON_INDEX_SIZE - 1;
+	   common_index[slot] != 0;
+	   slot = (slot + 1) & (COMMON_INDEX_SIZE - 1))
+	;
+      common_index[slot] = c + 1;
+    }
+}
+
 /* This function is called just after h->url has been set. It
  * parses out the path and query string parameters from the URL
  * and stores them separately.
@@ -280,7 +744,8 @@ parse_url (http_request h)
     {
       char *p, *t;
 
-      p = pstrdup (h->pool, h->url);
+      p = request_alloc (h, strlen (h->url) + 1);
+      strcpy (p, h->url);
       t = strchr (p, '?');
 
       if (t == 0)		/* No query string. */
@@ -361,44 +826,158 @@ http_request_version (http_request h, int *major, int *minor)
 int
 http_request_nr_headers (http_request h)
 {
-  return sash_size (h->headers);
+  return h->nr_headers;
 }
 
 vector
 http_request_get_headers (http_request h)
 {
-  vector keys = sash_keys (h->headers);
-  vector r = new_vector (h->pool, struct http_header);
+  vector r = new_vector (request_pool (h), struct http_header);
   int i;
 
-  for (i = 0; i < vector_size (keys); ++i)
+  for (i = 0; i < h->nr_headers; ++i)
+    vector_push_back (r, h->headers[i]);
+  return r;
+}
+
+const char *
+http_request_get_header (http_request h, const char *key)
+{
+  int len = strlen (key), c, i;
+  unsigned hash = hash_header (key, len), slot;
+
+  c = lookup_common_header (key, len, hash);
+  if (c >= 0)
+    return h->common[c];
+
+  if (h->index == 0)		/* HTTP/0.9 request. */
+    return 0;
+
+  for (slot = hash & h->index_mask;
+       (i = h->index[slot]) != 0;
+       slot = (slot + 1) & h->index_mask)
+    if (strcasecmp (h->headers[i-1].key, key) == 0)
+      return h->headers[i-1].value;
+  return 0;
+}
+
+/* Work out how the body of the request is going to be sent. */
+static int
+start_body (http_request h)
+{
+  const char *te, *cl;
+  char *end;
+
+  if (h->method != HTTP_METHOD_POST)
+    {
+      h->body_state = BODY_DONE;
+      return 0;
+    }
+
+  te = http_request_get_header (h, "Transfer-Encoding");
+  cl = http_request_get_header (h, "Content-Length");
+  if (te && strcasecmp (te, "chunked") == 0)
+    {
+      h->body_state = BODY_CHUNKED;
+      h->body_left = 0;
+    }
+  else if (cl)
     {
-      struct http_header header;
-      char *key;
+      h->body_state = BODY_LENGTH;
+      h->body_left = strtoll (cl, &end, 10);
+      if (end == cl || *end != '\0' || h->body_left < 0)
+	return -1;
+    }
+  else if (h->major == 1 && h->minor == 0)
+    h->body_state = BODY_EOF;	/* HTTP/1.0: body continues to EOF. */
+  else				/* RFC 7230, 3.3.3: no body. */
+    h->body_state = BODY_DONE;
+
+  return 0;
+}
 
-      vector_get (keys, i, key);
-      header.key = key;
-      sash_get (h->headers, key, header.value);
+/* Read the size line at the start of the next chunk. At the end of
+ * the body, also skip over any trailer headers.
+ */
+static int
+start_chunk (http_request h, io_handle io)
+{
+  char line[MAX_LINE_LENGTH], *end;
 
-      vector_push_back (r, header);
+  if (!io_fgets (line, sizeof line, io, 0))
+    return -1;
+  h->body_left = strtoll (line, &end, 16);
+  if (end == line || h->body_left < 0)
+    return -1;
+
+  if (h->body_left == 0)
+    {
+      do
+	if (!io_fgets (line, sizeof line, io, 0))
+	  return -1;
+      while (line[0] != '\0');
+      h->body_state = BODY_DONE;
     }
 
-  return r;
+  return 0;
 }
 
-const char *
-http_request_get_header (http_request h, const char *key)
+int
+http_request_read_body (http_request h, io_handle io, void *buf, int len)
 {
-  char *k = alloca (strlen (key) + 1);
-  const char *v;
+  int n, r;
+
+  if (h->body_state == BODY_START && start_body (h) == -1)
+    return -1;
+
+ again:
+  switch (h->body_state)
+    {
+    case BODY_LENGTH:
+      if (h->body_left == 0)
+	{
+	  h->body_state = BODY_DONE;
+	  return 0;
+	}
+      n = h->body_left < len ? h->body_left : len;
+      r = io_fread (buf, 1, n, io);
+      if (r < n)
+	return -1;		/* Unexpected EOF. */
+      h->body_left -= r;
+      return r;
+
+    case BODY_CHUNKED:
+      if (h->body_left == 0)
+	{
+	  if (start_chunk (h, io) == -1)
+	    return -1;
+	  goto again;
+	}
+      n = h->body_left < len ? h->body_left : len;
+      r = io_fread (buf, 1, n, io);
+      if (r < n)
+	return -1;
+      h->body_left -= r;
+
+      /* Skip the CRLF at the end of the chunk. */
+      if (h->body_left == 0)
+	{
+	  char line[4];
 
-  /* Canonicalize the key. */
-  strcpy (k, key);
-  pstrlwr (k);
+	  if (!io_fgets (line, sizeof line, io, 0) || line[0] != '\0')
+	    return -1;
+	}
+      return r;
 
-  sash_get (h->headers, k, v);
+    case BODY_EOF:
+      r = io_fread (buf, 1, len, io);
+      if (r == 0)
+	h->body_state = BODY_DONE;
+      return r;
 
-  return v;
+    default:
+      return 0;
+    }
 }
 
 const char *
@@ -415,7 +994,7 @@ http_request_get_cookie (http_request h, const char *key)
 
   /* Split it into pieces at whitespace, commas or semi-colons. */
   if (!re) re = precomp (global_pool, "[ \t\n,;]+", 0);
-  v = pstrresplit (h->pool, cookie_hdr, re);
+  v = pstrresplit (request_pool (h), cookie_hdr, re);
 
   for (i = 0; i < vector_size (v); ++i)
     {
@@ -432,7 +1011,7 @@ http_request_get_cookie (http_request h, const char *key)
 	  if (strncasecmp (str, key, keylen) == 0
 	      && str[keylen] == '=')
 	    {
-	      return cgi_unescape (h->pool, &str[keylen+1]);
+	      return cgi_unescape (request_pool (h), &str[keylen+1]);
 	    }
 	}
     }
@@ -445,7 +1024,15 @@ new_http_response (pool pool, http_request request,
 		   io_handle io,
 		   int code, const char *msg)
 {
-  http_response h = pmalloc (pool, sizeof *h);
+  http_response h;
+
+  /* A response lasts no longer than its request, so if the request
+   * came from an arena, so does the response.
+   */
+  if (request->arena)
+    h = http_arena_alloc (request->arena, sizeof *h);
+  else
+    h = pmalloc (pool, sizeof *h);
 
   memset (h, 0, sizeof *h);
 
@@ -472,13 +1059,20 @@ void
 http_response_send_header (http_response h,
 			   const char *key, const char *value)
 {
+  struct iovec iov[4];
+
   /* HTTP/0.9? No response line or headers. */
   if (h->request->is_http09) return;
 
-  io_fputs (key, h->io);
-  io_fputs (": ", h->io);
-  io_fputs (value, h->io);
-  io_fputs (CRLF, h->io);
+  iov[0].iov_base = (void *) key;
+  iov[0].iov_len = strlen (key);
+  iov[1].iov_base = ": ";
+  iov[1].iov_len = 2;
+  iov[2].iov_base = (void *) value;
+  iov[2].iov_len = strlen (value);
+  iov[3].iov_base = CRLF;
+  iov[3].iov_len = 2;
+  io_writev (h->io, iov, 4);
 
   /* Check for caller sending known header key and remove that
    * from the bitmap so we don't overwrite caller's header
@@ -529,22 +1123,28 @@ http_response_end_headers (http_response h)
   if (h->request->is_http09)
     goto out;
 
-  /* Send any remaining headers. */
-  if (h->extra_headers & _HTTP_XH_SERVER)
-    http_response_send_header (h, "Server", servername);
-
-#if HAVE_STRFTIME && HAVE_GMTIME
-  /* See RFC 2616 section 3.3.1. */
-  if (h->extra_headers & _HTTP_XH_DATE)
+  /* Send any remaining headers. The Server and Date headers are
+   * preformatted, so we just copy whichever are needed.
+   */
+  if (h->extra_headers & (_HTTP_XH_SERVER | _HTTP_XH_DATE))
     {
-      time_t t;
-      char s[64];
+      const char *start;
+      int len;
+
+      update_header_cache (http_request_time (h->request));
+
+      start = header_cache.block;
+      len = header_cache.len;
+      if (!(h->extra_headers & _HTTP_XH_SERVER))
+	{
+	  start += header_cache.date_offset;
+	  len -= header_cache.date_offset;
+	}
+      else if (!(h->extra_headers & _HTTP_XH_DATE))
+	len = header_cache.date_offset;
 
-      t = http_request_time (h->request);
-      strftime (s, sizeof s, "%a, %d %b %Y %H:%M:%S GMT", gmtime (&t));
-      http_response_send_header (h, "Date", s);
+      io_fwrite (start, 1, len, h->io);
     }
-#endif
 
   /* This is not correct: see RFC 2616 section 3.4.1 for more details. */
   if (h->extra_headers & _HTTP_XH_CONTENT_TYPE)
@@ -609,34 +1209,178 @@ http_response_end_headers (http_response h)
   io_fputs (CRLF, h->io);
 
  out:
-  if (log_fp) do_logging (h);
+  if (log_fp || async_log.pid) do_logging (h);
+
+  return close;
+}
+
+int
+http_response_send_file (http_response h, int fd, off_t offset, off_t length)
+{
+  char s[32];
+  int close;
+
+  /* Send the rest of the file? */
+  if (length < 0)
+    {
+      struct stat statbuf;
+
+      if (fstat (fd, &statbuf) == -1)
+	pth_die ("http_response_send_file: fstat");
+      length = statbuf.st_size > offset ? statbuf.st_size - offset : 0;
+    }
+
+  snprintf (s, sizeof s, "%lld", (long long) length);
+  http_response_send_header (h, "Content-Length", s);
+  close = http_response_end_headers (h);
+
+  if (http_request_is_HEAD (h->request)) return close;
+
+  /* If the file was shorter than we said, the client will be waiting
+   * for the rest of it, so we have to close the connection.
+   */
+  if (io_sendfile (h->io, fd, offset, length) < length)
+    close = 1;
 
   return close;
 }
 
+void
+http_response_set_chunk_buffer (http_response h, int threshold)
+{
+  http_response_flush_chunk (h);
+
+  h->chunk_threshold = threshold > 0 ? threshold : 0;
+  if (threshold <= 0)
+    h->chunk_buf = 0;
+  else if (h->request->arena)
+    h->chunk_buf = http_arena_alloc (h->request->arena, threshold);
+  else
+    h->chunk_buf = pmalloc (h->pool, threshold);
+}
+
+void
+http_response_flush_chunk (http_response h)
+{
+  if (h->chunk_used > 0)
+    {
+      send_chunk (h, 0, 0);
+      h->chunk_used = 0;
+    }
+}
+
 void
 http_response_write_chunk (http_response h, const char *data, int length)
 {
-  io_fprintf (h->io, "%X" CRLF, length);
-  io_fwrite (data, 1, length, h->io);
-  io_fprintf (h->io, CRLF);
+  /* An empty chunk would mark the end of the data. */
+  if (length <= 0) return;
+
+  if (h->chunk_buf)
+    {
+      /* Room in the buffer? */
+      if (h->chunk_used + length < h->chunk_threshold)
+	{
+	  memcpy (h->chunk_buf + h->chunk_used, data, length);
+	  h->chunk_used += length;
+	  return;
+	}
+
+      /* Send the buffered data and this data together as one chunk. */
+      send_chunk (h, data, length);
+      h->chunk_used = 0;
+      return;
+    }
+
+  send_chunk (h, data, length);
+}
+
+/* Send anything in the chunk buffer, followed by data, as a single
+ * chunk. The chunk size, data and trailing CRLF are all sent together.
+ */
+static void
+send_chunk (http_response h, const char *data, int length)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  char size[16], *p = size + sizeof size;
+  struct iovec iov[4];
+  int n = h->chunk_used + length;
+
+  /* Format the chunk size in hex, backwards from the end of size. */
+  *--p = '\n';
+  *--p = '\r';
+  do
+    {
+      *--p = hex[n & 15];
+      n >>= 4;
+    }
+  while (n > 0);
+
+  iov[0].iov_base = p;
+  iov[0].iov_len = size + sizeof size - p;
+  iov[1].iov_base = h->chunk_buf;
+  iov[1].iov_len = h->chunk_used;
+  iov[2].iov_base = (void *) data;
+  iov[2].iov_len = length;
+  iov[3].iov_base = CRLF;
+  iov[3].iov_len = 2;
+  io_writev (h->io, iov, 4);
 }
 
 void
 http_response_write_chunk_string (http_response h, const char *string)
 {
-  io_fprintf (h->io, "%X" CRLF "%s" CRLF, strlen (string), string);
+  http_response_write_chunk (h, string, strlen (string));
 }
 
 void
 http_response_write_chunk_end (http_response h)
 {
+  http_response_flush_chunk (h);
   io_fputs ("0" CRLF, h->io);
 }
 
+/* Reformat the cached Server and Date headers if the time or the
+ * server name has changed.
+ */
+static void
+update_header_cache (time_t t)
+{
+  char date[64];
+  int n;
+
+  if (t == header_cache.t && servername == header_cache.servername)
+    return;
+
+  /* See RFC 2616 section 3.3.1. */
+#if HAVE_STRFTIME && HAVE_GMTIME
+  strftime (date, sizeof date, "%a, %d %b %Y %H:%M:%S GMT", gmtime (&t));
+#else
+  date[0] = '\0';
+#endif
+
+  n = strlen (servername) + strlen (date) + 32;
+  if (n > header_cache.block_size)
+    {
+      header_cache.block_size = n;
+      header_cache.block = prealloc (global_pool, header_cache.block, n);
+    }
+
+  header_cache.date_offset = sprintf (header_cache.block,
+				      "Server: %s" CRLF, servername);
+  header_cache.len = header_cache.date_offset;
+#if HAVE_STRFTIME && HAVE_GMTIME
+  header_cache.len += sprintf (header_cache.block + header_cache.len,
+			       "Date: %s" CRLF, date);
+#endif
+
+  header_cache.t = t;
+  header_cache.servername = servername;
+}
+
 FILE *
 http_set_log_file (FILE *fp)
 {
+  log_strings_stale = 1;
   return log_fp = fp;
 }
 
@@ -649,28 +1393,64 @@ http_get_log_file (void)
 static void
 do_logging (http_response h)
 {
-#if HAVE_STRFTIME && HAVE_GMTIME
-  char time_str[64];
-  struct tm *tm;
-  time_t t;
-#else
   const char *time_str;
-#endif
   const char *referer;
   const char *method;
   const char *url;
   const char *user_agent;
   int major, minor;
-  struct sockaddr_in addr;
-  socklen_t addrlen;
   const char *addr_str;
   int port;
 
+  if (async_log.pid && log_rotate_pending)
+    queue_log_rotation ();
+
+  if (log_format == HTTP_LOG_FORMAT_BINARY)
+    {
+      struct http_log_request r;
+      const char *str;
+
+      r.len = sizeof r;
+      r.type = HTTP_LOG_REQUEST;
+      r.method = h->request->method;
+      r.time = http_request_time (h->request);
+      r.code = h->code;
+      r.major = h->request->major;
+      r.minor = h->request->minor;
+      r.unused = 0;
+      r.length = h->content_length;
+      r.latency = reactor_time - h->request->start;
+      r.referer = r.user_agent = 0;
+
+      /* If a string couldn't be written, the record would refer to an
+       * undefined string, so drop it too.
+       */
+      if (log_string (io_get_peername (h->io, &port), &r.peer) == -1 ||
+	  log_string (h->request->original_url, &r.url) == -1 ||
+	  ((str = http_request_get_header (h->request, "Referer")) &&
+	   log_string (str, &r.referer) == -1) ||
+	  ((str = http_request_get_header (h->request, "User-Agent")) &&
+	   log_string (str, &r.user_agent) == -1))
+	{
+	  async_log.drops++;
+	  return;
+	}
+      r.port = port;
+      r.pid = log_strings.pid;
+
+      write_log_record (&r, sizeof r);
+      return;
+    }
+
   /* Get the request time. */
 #if HAVE_STRFTIME && HAVE_GMTIME
-  t = http_request_time (h->request);
-  tm = gmtime (&t);
-  strftime (time_str, sizeof time_str, "%Y/%m/%d %H:%M:%S", tm);
+  if (http_request_time (h->request) != header_cache.log_t)
+    {
+      header_cache.log_t = http_request_time (h->request);
+      strftime (header_cache.log_time, sizeof header_cache.log_time,
+		"%Y/%m/%d %H:%M:%S", gmtime (&header_cache.log_t));
+    }
+  time_str = header_cache.log_time;
 #else
   time_str = "- -";
 #endif
@@ -689,10 +1469,26 @@ do_logging (http_response h)
   http_request_version (h->request, &major, &minor);
 
   /* Get the address and port number of the peer (client). */
-  addrlen = sizeof addr;
-  getpeername (io_fileno (h->io), (struct sockaddr *) &addr, &addrlen);
-  addr_str = inet_ntoa (addr.sin_addr);
-  port = ntohs (addr.sin_port);
+  addr_str = io_get_peername (h->io, &port);
+
+  if (async_log.pid)
+    {
+      char record[PIPE_BUF];
+      int len;
+
+      /* Records must fit in a single atomic write down the pipe. */
+      len = snprintf (record, sizeof record,
+		      "%s %s:%d \"%s %s HTTP/%d.%d\" %d %d \"%s\" \"%s\"\n",
+		      time_str, addr_str, port, method, url, major, minor,
+		      h->code, h->content_length, referer, user_agent);
+      if (len >= sizeof record)
+	{
+	  len = sizeof record - 1;
+	  record[len-1] = '\n';
+	}
+      append_async_log (record, len);
+      return;
+    }
 
   fprintf (log_fp,
 	   "%s %s:%d \"%s %s HTTP/%d.%d\" %d %d \"%s\" \"%s\"\n",
@@ -700,3 +1496,621 @@ do_logging (http_response h)
 	   h->code, h->content_length, referer, user_agent);
   fflush (log_fp);
 }
+
+/* Write a binary log record, to the async log if it is running.
+ * Returns 0 if the record was written (or queued), or -1 if not.
+ */
+static int
+write_log_record (const void *record, int len)
+{
+  if (async_log.pid)
+    return append_async_log (record, len);
+
+  if (fwrite (record, len, 1, log_fp) != 1)
+    return -1;
+  fflush (log_fp);
+  return 0;
+}
+
+/* Get the number of a string in the binary log, writing the string
+ * out first if it hasn't been seen before. Numbers start at 1, so that
+ * 0 can mean no string. Returns 0, or -1 if the string couldn't be
+ * written out, in which case it is not given a number.
+ */
+static int
+log_string (const char *str, unsigned *idp)
+{
+  struct
+  {
+    struct http_log_string hdr;
+    char str[LOG_MAX_STRING_LEN];
+  } r;
+  unsigned id;
+  int len;
+
+  if (log_strings_stale || log_strings.nr >= LOG_MAX_STRINGS)
+    {
+      if (log_strings.pool) delete_pool (log_strings.pool);
+      log_strings.pool = 0;
+      log_strings_stale = 0;
+    }
+
+  if (log_strings.pool == 0)
+    {
+      log_strings.pool = new_subpool (global_pool);
+      log_strings.ids = new_shash (log_strings.pool, unsigned);
+      log_strings.nr = 0;
+      log_strings.pid = getpid ();
+      if (log_strings.next_id == 0) log_strings.next_id = 1;
+    }
+
+  if (shash_get (log_strings.ids, str, id))
+    {
+      *idp = id;
+      return 0;
+    }
+
+  id = log_strings.next_id++;
+
+  len = strlen (str);
+  if (len > LOG_MAX_STRING_LEN) len = LOG_MAX_STRING_LEN;
+  r.hdr.len = sizeof r.hdr + len;
+  r.hdr.type = HTTP_LOG_STRING;
+  r.hdr.unused = 0;
+  r.hdr.pid = log_strings.pid;
+  r.hdr.id = id;
+  memcpy (r.str, str, len);
+  if (write_log_record (&r, r.hdr.len) == -1)
+    return -1;
+
+  shash_insert (log_strings.ids, str, id);
+  log_strings.nr++;
+  *idp = id;
+  return 0;
+}
+
+static void
+wake_log_writer (void *data)
+{
+  async_log.timer = 0;
+  start_log_writer ();
+}
+
+/* Append a record to the ring, or drop it if the ring is full.
+ * Returns 0 if the record was queued, or -1 if it was dropped.
+ */
+static int
+append_async_log (const char *record, int len)
+{
+  if (put_async_log (record, len) == -1)
+    {
+      async_log.drops++;
+      return -1;
+    }
+  return 0;
+}
+
+static int
+put_async_log (const char *record, int len)
+{
+  int head, n;
+
+  /* If the ring is full, try to make room by writing to the pipe
+   * directly (it is non-blocking). Only fail if the pipe is full
+   * too, or if the writer thread is in the middle of writing.
+   */
+  while (async_log.size - async_log.used < len)
+    if (async_log.writing || write_async_log (0) == -1)
+      return -1;
+
+  head = (async_log.tail + async_log.used) % async_log.size;
+  n = async_log.size - head;
+  if (n > len) n = len;
+  memcpy (async_log.ring + head, record, n);
+  memcpy (async_log.ring, record + n, len - n);
+  async_log.used += len;
+
+  if (async_log.used >= async_log.flush_size)
+    start_log_writer ();
+  else if (async_log.timer == 0)
+    async_log.timer = reactor_set_timer (global_pool,
+					 async_log.flush_interval,
+					 wake_log_writer, 0);
+  return 0;
+}
+
+/* Write out the oldest records in the ring. At most PIPE_BUF bytes
+ * are written at a time, ending on a record boundary, so that writes
+ * are atomic even if several (forked) processes share the pipe.
+ * If wait is true and the pipe is full, the current thread waits for
+ * it, otherwise this just tries once. Returns the number of bytes
+ * written, or -1 on error.
+ */
+static int
+write_async_log (int wait)
+{
+  struct iovec iov[2];
+  int n, r;
+
+  n = async_log.used < PIPE_BUF ? async_log.used : PIPE_BUF;
+  if (n < async_log.used)
+    {
+      if (!async_log.binary)
+	while (n > 0 &&
+	       async_log.ring[(async_log.tail + n - 1) % async_log.size]
+	       != '\n')
+	  n--;
+      else
+	{
+	  /* Binary records start with their length. */
+	  unsigned short len;
+	  char *p = (char *) &len;
+	  int i = 0, j;
+
+	  for (;;)
+	    {
+	      for (j = 0; j < sizeof len; ++j)
+		p[j] = async_log.ring[(async_log.tail + i + j) % async_log.size];
+	      if (len == 0 || i + len > n) break;
+	      i += len;
+	    }
+	  n = i;
+	}
+    }
+
+  iov[0].iov_base = async_log.ring + async_log.tail;
+  iov[0].iov_len = async_log.size - async_log.tail;
+  if (iov[0].iov_len > n) iov[0].iov_len = n;
+  iov[1].iov_base = async_log.ring;
+  iov[1].iov_len = n - iov[0].iov_len;
+
+  if (wait)
+    {
+      async_log.writing = 1;
+      r = pth_writev (async_log.fd, iov, iov[1].iov_len ? 2 : 1);
+      async_log.writing = 0;
+    }
+  else
+    r = writev (async_log.fd, iov, iov[1].iov_len ? 2 : 1);
+  if (r <= 0)
+    return -1;
+
+  async_log.tail = (async_log.tail + r) % async_log.size;
+  async_log.used -= r;
+  return r;
+}
+
+static void
+log_writer (void *data)
+{
+  while (async_log.used > 0)
+    if (write_async_log (1) == -1)
+      {
+	syslog (LOG_ERR, "http: async log writer: %m");
+	async_log.used = 0;
+      }
+
+  async_log.running = 0;
+}
+
+/* Start a thread to write out the ring, unless one is already doing
+ * so. The thread exits as soon as the ring is empty, so that it
+ * doesn't keep the program running once all other threads are done.
+ */
+static void
+start_log_writer (void)
+{
+  if (async_log.running) return;
+
+  async_log.running = 1;
+  pth_start (new_pseudothread (new_pool (), log_writer, 0,
+			       "http async log writer"));
+}
+
+/* Write out whatever is left in the ring when the program exits. */
+static void
+flush_async_log (void)
+{
+  int flags;
+
+  if (async_log.pid == 0) return;
+
+  flags = fcntl (async_log.fd, F_GETFL);
+  fcntl (async_log.fd, F_SETFL, flags & ~O_NONBLOCK);
+  while (async_log.used > 0 && write_async_log (0) > 0)
+    ;
+}
+
+/* Put a rotation marker in the ring. If there is no room for it,
+ * try again before the next record.
+ */
+static void
+queue_log_rotation (void)
+{
+  struct http_log_string marker;
+  int r;
+
+  log_rotate_pending = 0;
+
+  if (async_log.binary)
+    {
+      memset (&marker, 0, sizeof marker);
+      marker.len = sizeof marker;
+      marker.type = LOG_ROTATE;
+      marker.pid = getpid ();
+      r = put_async_log ((const char *) &marker, sizeof marker);
+    }
+  else				/* Text records never contain '\0'. */
+    r = put_async_log ("\0\n", 2);
+
+  if (r == -1)
+    log_rotate_pending = 1;
+  else
+    /* The new log file must start with fresh string definitions. */
+    log_strings_stale = 1;
+}
+
+/* The application's own SIGHUP handler, if it had one. */
+static struct sigaction old_sighup;
+
+static void
+forward_sighup (int sig, siginfo_t *info, void *ctx)
+{
+  if (async_log.pid)
+    log_rotate_pending = 1;
+  else
+    log_strings_stale = 1;
+
+  if (old_sighup.sa_flags & SA_SIGINFO)
+    old_sighup.sa_sigaction (sig, info, ctx);
+  else if (old_sighup.sa_handler != SIG_DFL &&
+	   old_sighup.sa_handler != SIG_IGN)
+    old_sighup.sa_handler (sig);
+}
+
+/* The child process which actually writes the log file. Records
+ * arrive down the pipe in order. When a rotation marker arrives the
+ * file is reopened under its original name.
+ *
+ * Several (forked) server processes may share the pipe, and each
+ * sends its own marker. In the binary format, records refer to
+ * strings defined earlier by the same process, so until a process's
+ * marker arrives its records still go to the old file. We remember
+ * which generation of the file each process is writing to.
+ */
+static struct
+{
+  const char *filename;
+  int fd;			/* Current log file. */
+  int old_fd;			/* Previous log file, or -1. */
+  int gen;			/* Generation of current log file. */
+  struct
+  {
+    unsigned pid;
+    int gen;			/* Generation this process writes to. */
+  } writers[LOG_MAX_WRITERS];
+  int nr_writers;
+} log_child;
+
+static void
+write_all (int fd, const char *buf, int len)
+{
+  int r;
+
+  while (len > 0)
+    {
+      r = write (fd, buf, len);
+      if (r == -1)
+	{
+	  if (errno == EINTR) continue;
+	  syslog (LOG_ERR, "http: %s: %m", log_child.filename);
+	  return;
+	}
+      buf += r;
+      len -= r;
+    }
+}
+
+/* Open the log file again, keeping the old one open. Returns 0, or -1
+ * if the file couldn't be opened, in which case we carry on with the
+ * old one rather than losing every record from now on.
+ */
+static int
+reopen_log_file (void)
+{
+  int fd;
+
+  fd = open (log_child.filename, O_WRONLY|O_APPEND|O_CREAT, 0644);
+  if (fd == -1)
+    {
+      syslog (LOG_ERR, "http: %s: %m", log_child.filename);
+      return -1;
+    }
+
+  if (log_child.old_fd >= 0) close (log_child.old_fd);
+  log_child.old_fd = log_child.fd;
+  log_child.fd = fd;
+  log_child.gen++;
+  return 0;
+}
+
+/* Text records are independent, so the file is reopened when the
+ * first marker arrives, and later markers are ignored unless the file
+ * has been renamed again. Returns the number of bytes used.
+ */
+static int
+write_text_log (char *buf, int n)
+{
+  struct stat file_st, fd_st;
+  char *p;
+  int start = 0;
+
+  while ((p = memchr (buf + start, '\0', n - start)) != 0)
+    {
+      if (p + 1 == buf + n) break; /* Rest of marker not here yet. */
+
+      write_all (log_child.fd, buf + start, p - (buf + start));
+      start = p + 2 - buf;
+
+      if (stat (log_child.filename, &file_st) == -1 ||
+	  fstat (log_child.fd, &fd_st) == -1 ||
+	  file_st.st_dev != fd_st.st_dev || file_st.st_ino != fd_st.st_ino)
+	if (reopen_log_file () == 0)
+	  {
+	    close (log_child.old_fd);
+	    log_child.old_fd = -1;
+	  }
+    }
+
+  if (p == 0)
+    {
+      write_all (log_child.fd, buf + start, n - start);
+      return n;
+    }
+  write_all (log_child.fd, buf + start, p - (buf + start));
+  return p - buf;
+}
+
+/* Find (or add) the entry for the process which wrote a record. */
+static int *
+writer_gen (unsigned pid)
+{
+  static int gen;
+  int i;
+
+  for (i = 0; i < log_child.nr_writers; ++i)
+    if (log_child.writers[i].pid == pid)
+      return &log_child.writers[i].gen;
+
+  if (i == LOG_MAX_WRITERS)
+    {
+      gen = log_child.gen;
+      return &gen;
+    }
+
+  log_child.writers[i].pid = pid;
+  log_child.writers[i].gen = log_child.gen;
+  log_child.nr_writers++;
+  return &log_child.writers[i].gen;
+}
+
+static void
+rotate_binary_log (int *gen)
+{
+  int i, j;
+
+  if (*gen == log_child.gen)
+    {
+      /* First marker since the last rotation. Forget processes which
+       * never caught up with the last rotation, they have probably
+       * exited.
+       */
+      for (i = j = 0; i < log_child.nr_writers; ++i)
+	if (log_child.writers[i].gen == log_child.gen)
+	  log_child.writers[j++] = log_child.writers[i];
+      log_child.nr_writers = j;
+
+      if (reopen_log_file () == -1)
+	return;
+    }
+  *gen = log_child.gen;
+
+  /* Close the old file once every process has moved on from it. */
+  for (i = 0; i < log_child.nr_writers; ++i)
+    if (log_child.writers[i].gen != log_child.gen)
+      return;
+  if (log_child.old_fd >= 0)
+    {
+      close (log_child.old_fd);
+      log_child.old_fd = -1;
+    }
+}
+
+/* Returns the number of bytes used. */
+static int
+write_binary_log (char *buf, int n)
+{
+  struct http_log_string hdr;
+  int i = 0, start = 0, dest = log_child.fd, fd, *gen;
+
+  while (n - i >= sizeof hdr)
+    {
+      memcpy (&hdr, buf + i, sizeof hdr);
+      if (hdr.len < sizeof hdr)
+	{
+	  /* Corrupt. Write it all out and hope for the best. */
+	  i = n;
+	  break;
+	}
+      if (n - i < hdr.len) break;
+
+      gen = writer_gen (hdr.pid);
+      if (hdr.type == LOG_ROTATE)
+	{
+	  write_all (dest, buf + start, i - start);
+	  start = i + hdr.len;
+	  rotate_binary_log (gen);
+	  dest = log_child.fd;
+	}
+      else
+	{
+	  fd = *gen == log_child.gen || log_child.old_fd == -1
+	    ? log_child.fd : log_child.old_fd;
+	  if (fd != dest)
+	    {
+	      write_all (dest, buf + start, i - start);
+	      start = i;
+	      dest = fd;
+	    }
+	}
+      i += hdr.len;
+    }
+
+  write_all (dest, buf + start, i - start);
+  return i;
+}
+
+static void
+log_process (const char *filename, int in, int fd, int binary)
+{
+  struct sigaction sa;
+  char buffer[65536];
+  int r, used = 0;
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_handler = SIG_IGN;
+  sigaction (SIGINT, &sa, 0);
+  sigaction (SIGQUIT, &sa, 0);
+  sigaction (SIGTERM, &sa, 0);
+  sigaction (SIGHUP, &sa, 0);	/* Rotation markers come down the pipe. */
+
+  log_child.filename = filename;
+  log_child.fd = fd;
+  log_child.old_fd = -1;
+
+  for (;;)
+    {
+      r = read (in, buffer + used, sizeof buffer - used);
+      if (r == 0) break;
+      if (r == -1)
+	{
+	  if (errno == EINTR) continue;
+	  syslog (LOG_ERR, "http: async log: %m");
+	  break;
+	}
+      used += r;
+
+      r = binary ? write_binary_log (buffer, used)
+	: write_text_log (buffer, used);
+      memmove (buffer, buffer + r, used - r);
+      used -= r;
+    }
+
+  _exit (0);
+}
+
+int
+http_set_async_log_file (const char *filename, int ring_size,
+			 int flush_interval, int flush_size)
+{
+  struct sigaction sa;
+  int fds[2], fd, i, saved_errno;
+  pid_t pid;
+
+  if (async_log.pid)
+    {
+      errno = EBUSY;
+      return -1;
+    }
+
+  /* Open the file here, so that the caller finds out if it fails. */
+  fd = open (filename, O_WRONLY|O_APPEND|O_CREAT, 0644);
+  if (fd == -1)
+    return -1;
+
+  if (pipe (fds) == -1)
+    {
+      saved_errno = errno;
+      close (fd);
+      errno = saved_errno;
+      return -1;
+    }
+
+  pid = fork ();
+  if (pid == -1)
+    {
+      saved_errno = errno;
+      close (fd);
+      close (fds[0]);
+      close (fds[1]);
+      errno = saved_errno;
+      return -1;
+    }
+
+  if (pid == 0)			/* Child. */
+    {
+      for (i = 3; i < getdtablesize (); ++i)
+	if (i != fds[0] && i != fd) close (i);
+      log_process (filename, fds[0], fd,
+		   log_format == HTTP_LOG_FORMAT_BINARY);
+    }
+
+  close (fd);
+  close (fds[0]);
+  fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[1], F_SETFL, O_NONBLOCK);
+
+  async_log.pid = pid;
+  async_log.fd = fds[1];
+  async_log.size = ring_size > 0 ? ring_size : LOG_RING_SIZE;
+  async_log.ring = pmalloc (global_pool, async_log.size);
+  async_log.tail = async_log.used = 0;
+  async_log.flush_interval =
+    flush_interval > 0 ? flush_interval : LOG_FLUSH_INTERVAL;
+  async_log.flush_size = flush_size > 0 ? flush_size : LOG_FLUSH_SIZE;
+  if (async_log.flush_size > async_log.size)
+    async_log.flush_size = async_log.size;
+  async_log.binary = log_format == HTTP_LOG_FORMAT_BINARY;
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_sigaction = forward_sighup;
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigaction (SIGHUP, &sa, &old_sighup);
+
+  atexit (flush_async_log);
+
+  return 0;
+}
+
+void
+http_reopen_log_file (void)
+{
+  if (async_log.pid)
+    queue_log_rotation ();
+  else
+    log_strings_stale = 1;
+}
+
+int
+http_set_log_format (int format)
+{
+  /* The async log ring and writer only understand one format. */
+  if (async_log.pid && format != log_format)
+    {
+      errno = EBUSY;
+      return -1;
+    }
+  return log_format = format;
+}
+
+int
+http_get_log_format (void)
+{
+  return log_format;
+}
+
+unsigned long
+http_get_log_drops (void)
+{
+  return async_log.drops;
+}
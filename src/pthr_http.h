@@ -40,6 +40,9 @@ typedef struct http_request *http_request;
 struct http_response;
 typedef struct http_response *http_response;
 
+struct http_arena;
+typedef struct http_arena *http_arena;
+
 /* A vector of struct http_header is returned from the
  * HTTP_REQUEST_GET_HEADERS call.
  */
@@ -78,6 +81,7 @@ const char *http_set_servername (const char *new_server_name);
  * Function: http_request_get_headers
  * Function: http_request_get_header
  * Function: http_request_get_cookie
+ * Function: http_request_read_body
  *
  * These functions allow you to efficiently parse incoming
  * HTTP requests from conforming HTTP/0.9, HTTP/1.0 and HTTP/1.1
@@ -128,7 +132,12 @@ const char *http_set_servername (const char *new_server_name);
  * @code{value}. HTTP header keys are case insensitive when
  * searching, and you will find that the list of keys returned
  * by @code{http_request_get_headers} has been converted to
- * lowercase.
+ * lowercase. The headers are returned in the order in which
+ * they were sent. If a header is repeated, only the last value
+ * is kept. Common headers such as @code{Host}, @code{Cookie}
+ * and @code{Content-Length} are found by @code{http_request_get_header}
+ * without searching the list, and other headers are found through a
+ * hash table. A request with more than 100 headers is rejected.
  *
  * @code{http_request_get_cookie} gets a named browser cookie
  * sent in the request. It returns the value of the cookie
@@ -138,6 +147,18 @@ const char *http_set_servername (const char *new_server_name);
  * a @code{Set-Cookie} header with the appropriate content. Note
  * that not all browsers support cookies.
  *
+ * @code{http_request_read_body} reads up to @code{len} bytes of
+ * the body of a POST request from @code{io} into @code{buf}, so
+ * that large bodies can be processed a piece at a time. It deals
+ * with bodies sent with a @code{Content-Length} header, with
+ * chunked encoding, and (for HTTP/1.0 clients) bodies which run
+ * to the end of the connection. An HTTP/1.1 request with neither
+ * @code{Content-Length} nor chunked encoding has no body (RFC 7230,
+ * section 3.3.3). It returns the number of bytes read, 0 at the
+ * end of the body (or if the request has no body), or -1 if the
+ * body is malformed or the connection closes early.
+ * @ref{new_cgi(3)} uses this to read POSTed parameters.
+ *
  * See also: @ref{new_http_response(3)}, @ref{new_cgi(3)},
  * @ref{new_pseudothread(3)}, @ref{io_fdopen(3)}, RFC 2616.
  */
@@ -155,14 +176,61 @@ extern int http_request_nr_headers (http_request);
 extern vector http_request_get_headers (http_request);
 extern const char *http_request_get_header (http_request h, const char *key);
 extern const char *http_request_get_cookie (http_request h, const char *key);
+extern int http_request_read_body (http_request h, io_handle io, void *buf, int len);
+
+/* Function: new_http_arena - per-request memory for keep-alive connections
+ * Function: http_request_begin
+ * Function: http_request_end
+ * Function: http_arena_pool
+ * Function: http_arena_alloc
+ *
+ * A server which allocates each request from the connection's pool
+ * (see @ref{new_http_request(3)}) uses more and more memory for as
+ * long as the client keeps the connection open. An arena avoids
+ * this by reusing the same memory for each request on the connection.
+ *
+ * @code{new_http_arena} creates an arena in the connection's
+ * @code{pool}.
+ *
+ * @code{http_request_begin} reads and parses the next request
+ * on @code{io}, in the same way as @code{new_http_request}, but
+ * allocating from the arena. It returns @code{NULL} if the stream
+ * closes at the beginning of the request.
+ *
+ * @code{http_request_end} must be called once the response has been
+ * sent. All memory allocated for the request is released back to
+ * the arena, and the request must not be used afterwards.
+ *
+ * @code{http_arena_alloc} allocates @code{n} bytes of memory which
+ * is valid until @code{http_request_end}. This is very cheap, since
+ * it just moves a pointer along a chunk of memory.
+ *
+ * @code{http_arena_pool} returns a subpool of the connection's pool
+ * which is deleted by @code{http_request_end}, for use with functions
+ * such as @ref{new_cgi(3)} which need a @code{pool}. The subpool is
+ * created on demand, so a request which doesn't need it costs no
+ * @code{malloc} at all. A response to a request from an arena is
+ * itself allocated from the arena, so the connection's pool can be
+ * passed to @ref{new_http_response(3)}.
+ *
+ * See also: @ref{new_http_request(3)}, @ref{new_pool(3)}.
+ */
+extern http_arena new_http_arena (pool);
+extern http_request http_request_begin (http_arena, io_handle);
+extern void http_request_end (http_arena);
+extern pool http_arena_pool (http_arena);
+extern void *http_arena_alloc (http_arena, size_t n);
 
 /* Function: new_http_response - functions for sending HTTP responses
  * Function: http_response_send_header
  * Function: http_response_send_headers
  * Function: http_response_end_headers
+ * Function: http_response_send_file
  * Function: http_response_write_chunk
  * Function: http_response_write_chunk_string
  * Function: http_response_write_chunk_end
+ * Function: http_response_set_chunk_buffer
+ * Function: http_response_flush_chunk
  *
  * These functions allow you to efficiently generate outgoing HTTP
  * responses.
@@ -170,6 +238,9 @@ extern const char *http_request_get_cookie (http_request h, const char *key);
  * @code{new_http_response} generates a new HTTP response object and
  * returns it. @code{code} is the HTTP response code (see RFC 2616
  * for a list of codes), and @code{msg} is the HTTP response message.
+ * If the request was read by @ref{http_request_begin(3)}, the response
+ * is allocated from the same arena and is valid until
+ * @ref{http_request_end(3)}, otherwise it is allocated in @code{pool}.
  *
  * @code{http_response_send_header} sends a single HTTP header back
  * to the client. The header is constructed by concatenating
@@ -184,6 +255,16 @@ extern const char *http_request_get_cookie (http_request h, const char *key);
  * the code to emit any missing-but-required headers and then send
  * the final @code{CR LF} characters.
  *
+ * @code{http_response_send_file} sends @code{length} bytes of the
+ * file @code{fd}, starting at @code{offset}, as the body of the
+ * response. If @code{length} is -1 then it sends the rest of the
+ * file. It sends a @code{Content-Length} header and ends the headers,
+ * so it takes the place of @code{http_response_end_headers}, and it
+ * returns the same value. For @code{HEAD} requests only the headers
+ * are sent. The file data is sent with @ref{io_sendfile(3)}, so it
+ * is not copied through the program. The file descriptor is not
+ * closed.
+ *
  * @code{http_response_write_chunk}, @code{http_response_write_chunk_string}
  * and @code{http_response_write_chunk_end}
  * allow the caller to use chunked encoding, which is an
@@ -197,6 +278,17 @@ extern const char *http_request_get_cookie (http_request h, const char *key);
  * should call @code{http_response_write_chunk_end}.
  * (Steve Atkins implemented chunked encoding).
  *
+ * If the application writes lots of small pieces of data, each
+ * one becomes a chunk, which wastes bandwidth on chunk headers.
+ * @code{http_response_set_chunk_buffer} makes the response collect
+ * the data written by @code{http_response_write_chunk} and
+ * @code{http_response_write_chunk_string}, and send it as a single
+ * chunk once @code{threshold} bytes have been written. A
+ * @code{threshold} of 0 (the default) turns this off.
+ * @code{http_response_flush_chunk} sends any data collected so
+ * far as a chunk straightaway, and @code{http_response_write_chunk_end}
+ * does this too. Writing a zero length chunk does nothing.
+ *
  * See also: @ref{new_http_request(3)}, @ref{new_cgi(3)},
  * @ref{new_pseudothread(3)}, @ref{io_fdopen(3)}, RFC 2616.
  */
@@ -204,12 +296,20 @@ extern http_response new_http_response (pool, http_request, io_handle, int code,
 extern void http_response_send_header (http_response, const char *key, const char *value);
 extern void http_response_send_headers (http_response, ...);
 extern int http_response_end_headers (http_response h);
+extern int http_response_send_file (http_response h, int fd, off_t offset, off_t length);
 extern void http_response_write_chunk (http_response, const char *data, int length);
 extern void http_response_write_chunk_string (http_response, const char *string);
 extern void http_response_write_chunk_end (http_response);
+extern void http_response_set_chunk_buffer (http_response, int threshold);
+extern void http_response_flush_chunk (http_response);
 
 /* Function: http_set_log_file - enable HTTP logs on file pointer
  * Function: http_get_log_file
+ * Function: http_set_async_log_file
+ * Function: http_reopen_log_file
+ * Function: http_get_log_drops
+ * Function: http_set_log_format
+ * Function: http_get_log_format
  *
  * The @code{FILE *fp} argument to @code{http_set_log_file} sets
  * the file pointer on which HTTP logs are generated. To disable
@@ -221,6 +321,42 @@ extern void http_response_write_chunk_end (http_response);
  *
  * The default is that logging is disabled.
  *
+ * Logging to a file pointer writes and flushes each record as the
+ * request is handled, so a slow disk holds up every thread. Busy
+ * servers should use @code{http_set_async_log_file} instead, which
+ * appends log records to @code{filename} in the background. It forks
+ * a small child process which owns the file. Records are kept in a
+ * ring buffer of @code{ring_size} bytes, and a pseudothread passes
+ * them to the child in batches, at least every @code{flush_interval}
+ * milliseconds, or sooner if @code{flush_size} bytes are waiting.
+ * Any of these may be 0 to use the defaults (256 KBytes, 1 second
+ * and 16 KBytes). It returns 0 on success or -1 (setting
+ * @code{errno}) if the file could not be opened or the child process
+ * could not be started.
+ * The pseudothread only runs while it has records to pass on, so it
+ * doesn't stop a loop which waits for
+ * @ref{pseudothread_count_threads(3)} to reach 0. Records still in
+ * the ring when the program exits are written out then.
+ * Asynchronous logging, once started, takes precedence over
+ * @code{http_set_log_file}. It should be started before
+ * @ref{pthr_server_main_loop(3)} forks any worker processes, so that
+ * they all share the same log file.
+ *
+ * If the ring buffer fills up because the disk cannot keep up,
+ * further records are dropped rather than waiting.
+ * @code{http_get_log_drops} returns the number of records dropped.
+ *
+ * To rotate the log file, rename it and then send @code{SIGHUP} to
+ * the server (or call @code{http_reopen_log_file}). The log file
+ * is then reopened under the original name: records logged before
+ * the signal still go to the old file, and records logged after it
+ * to the new one, which is created when the first of them arrives.
+ * If it cannot
+ * be reopened, the error is sent to syslog and logging carries on
+ * in the old file. @code{http_set_async_log_file} installs its own
+ * @code{SIGHUP} handler, which calls any handler that the program
+ * had installed before.
+ *
  * Currently log messages are generated at the end of the
  * HTTP response headers and have the following fixed format:
  *
@@ -231,6 +367,24 @@ extern void http_response_write_chunk_end (http_response);
  * field is only known if the caller sends back a "Content-Length"
  * header. Otherwise 0 is printed in that position.
  *
+ * @code{http_set_log_format} chooses between the text format
+ * above (@code{HTTP_LOG_FORMAT_TEXT}, the default) and a compact
+ * binary format (@code{HTTP_LOG_FORMAT_BINARY}) which is much
+ * cheaper to generate. It should be called before logging starts.
+ * It returns @code{format}, or -1 (setting @code{errno} to
+ * @code{EBUSY}) if asynchronous logging has already been started
+ * in a different format.
+ * The binary log is a sequence of records, each starting with its
+ * length and type. A @code{struct http_log_request} is written for
+ * each request. Strings (the URL, peer address, referer and user
+ * agent) are written once in a @code{struct http_log_string} record,
+ * followed by the string itself, and after that are referred to by
+ * number. Numbers are only unique within a process (@code{pid}). The
+ * @code{latency} field is the time in milliseconds from receiving
+ * the request to sending the response headers. Records are in the
+ * byte order of the host. The @code{pthr_logconv} program converts
+ * binary logs to the text format.
+ *
  * Bugs: Log format should be customizable. It should be possible
  * (optionally, of course) to look up the IP address and print
  * a hostname.
@@ -238,7 +392,49 @@ extern void http_response_write_chunk_end (http_response);
  * See also: @ref{new_http_request(3)}, @ref{new_cgi(3)},
  * @ref{new_pseudothread(3)}, @ref{io_fdopen(3)}, RFC 2616.
  */
+/* Log formats. */
+#define HTTP_LOG_FORMAT_TEXT   0
+#define HTTP_LOG_FORMAT_BINARY 1
+
+/* Binary log record types. */
+#define HTTP_LOG_REQUEST 1
+#define HTTP_LOG_STRING  2
+
+struct http_log_request
+{
+  unsigned short len;		/* Length of this record. */
+  unsigned char type;		/* HTTP_LOG_REQUEST */
+  unsigned char method;		/* HTTP_METHOD_* */
+  unsigned int pid;		/* Process ID. */
+  unsigned int time;		/* Request time. */
+  unsigned short port;		/* Peer port number. */
+  unsigned short code;		/* Response code. */
+  unsigned char major, minor;	/* HTTP version. */
+  unsigned short unused;
+  unsigned int length;		/* Content length, or 0 if not known. */
+  unsigned int latency;		/* Latency (milliseconds). */
+  unsigned int peer;		/* Strings (0 means not present). */
+  unsigned int url;
+  unsigned int referer;
+  unsigned int user_agent;
+};
+
+struct http_log_string
+{
+  unsigned short len;		/* Length of this record and string. */
+  unsigned char type;		/* HTTP_LOG_STRING */
+  unsigned char unused;
+  unsigned int pid;		/* Process ID. */
+  unsigned int id;		/* String number. */
+  /* Followed by the string (not terminated). */
+};
+
 extern FILE *http_set_log_file (FILE *fp);
 extern FILE *http_get_log_file (void);
+extern int http_set_async_log_file (const char *filename, int ring_size, int flush_interval, int flush_size);
+extern void http_reopen_log_file (void);
+extern unsigned long http_get_log_drops (void);
+extern int http_set_log_format (int format);
+extern int http_get_log_format (void);
 
 #endif /* PTHR_HTTP_H */
@@ -23,11 +23,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
@@ -40,10 +45,26 @@
 #include <sys/wait.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
 #ifdef HAVE_ALLOCA_H
 #include <alloca.h>
 #endif
@@ -52,6 +73,16 @@
 
 #include "pthr_iolib.h"
 #include "pthr_pseudothread.h"
+#include "pthr_reactor.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+/* In adaptive mode, a buffer is doubled in size after it has been
+ * filled this many times in a row.
+ */
+#define ADAPTIVE_NR_FILLS 2
 
 struct io_handle
 {
@@ -65,51 +96,90 @@ struct io_handle
   char *inbuf;			/* The actual buffer. */
   char *inbufpos;		/* Current position within buffer. */
   int inbuflen;			/* Number of bytes left to read. */
+  int inbufsize;		/* Size of the buffer. */
 
   int inbufcount;		/* Total number of bytes read. */
+  int inbufcalls;		/* Total number of read system calls. */
+  int inbuffills;		/* Number of times in a row buffer filled. */
 
   /* The outgoing buffer. */
   char *outbuf;			/* The actual buffer. */
   char *outbufpos;		/* Current position within buffer. */
   int outbuffree;		/* Number of bytes free left in buffer. */
+  int outbufsize;		/* Size of the buffer. */
 
   int outbufcount;		/* Total number of bytes written. */
+  int outbufcalls;		/* Total number of write system calls. */
+  int outbuffills;		/* Number of times in a row buffer filled. */
 
   int outbufmode;		/* Output buffer mode. */
+
+  int maxbufsize;		/* Adaptive mode: largest buffer size. */
+
+  /* Address of the peer, looked up the first time it is needed. */
+  int peer_known;		/* Have we looked up the peer yet? */
+  char peer_addr[16];		/* Address as a string (dotted quad). */
+  int peer_port;		/* Port number. */
 };
 
 static void _flush (io_handle io, int ignore_errors);
+static void _flushv (io_handle io, const struct iovec *iov, int iovcnt, int ignore_errors);
 static void _err (io_handle io, const char *msg) __attribute__((noreturn));
 static void _do_close (io_handle io);
+static void _output_buffer_full (io_handle io);
+static int _refill (io_handle io);
 
 io_handle
 io_fdopen (int sock)
+{
+  return io_fdopen_with_bufsize (sock, IOLIB_INPUT_BUFFER_SIZE,
+				 IOLIB_OUTPUT_BUFFER_SIZE);
+}
+
+io_handle
+io_fdopen_with_bufsize (int sock, int inbufsize, int outbufsize)
 {
   io_handle io;
   pool pool = new_subpool (pth_get_pool (current_pth));
 
+  if (inbufsize <= 0) inbufsize = IOLIB_INPUT_BUFFER_SIZE;
+  if (outbufsize <= 0) outbufsize = IOLIB_OUTPUT_BUFFER_SIZE;
+
   io = pmalloc (pool, sizeof *io);
 
-  io->inbuf = pmalloc (pool, IOLIB_INPUT_BUFFER_SIZE * sizeof (char));
+  io->inbuf = pmalloc (pool, inbufsize * sizeof (char));
 
-  io->outbuf = pmalloc (pool, IOLIB_OUTPUT_BUFFER_SIZE * sizeof (char));
+  io->outbuf = pmalloc (pool, outbufsize * sizeof (char));
 
   io->pool = pool;
   io->sock = sock;
 
-  io->inbufpos = &io->inbuf[IOLIB_INPUT_BUFFER_SIZE]; /* Let ungetc work. */
+  io->inbufpos = &io->inbuf[inbufsize]; /* Let ungetc work. */
   io->inbuflen = 0;
+  io->inbufsize = inbufsize;
   io->inbufcount = 0;
+  io->inbufcalls = 0;
+  io->inbuffills = 0;
   io->outbufpos = io->outbuf;
-  io->outbuffree = IOLIB_OUTPUT_BUFFER_SIZE;
+  io->outbuffree = outbufsize;
+  io->outbufsize = outbufsize;
   io->outbufcount = 0;
+  io->outbufcalls = 0;
+  io->outbuffills = 0;
   io->outbufmode = IO_MODE_LINE_BUFFERED;
+  io->maxbufsize = 0;
+  io->peer_known = 0;
 
   /* Register to automagically close this I/O handle when we
    * exit this thread.
    */
   pool_register_cleanup_fn (pool, (void (*)(void *)) _do_close, io);
 
+  /* Keep the socket in the reactor for as long as it is open, so that
+   * blocking on it is cheap.
+   */
+  reactor_attach_fd (pool, sock);
+
   return io;
 }
 
@@ -117,7 +187,10 @@ inline int
 io_fflush (io_handle io)
 {
   if (io->outbufpos > io->outbuf)
-    _flush (io, 0);
+    {
+      _flush (io, 0);
+      io->outbuffills = 0;
+    }
 
   return 0;
 }
@@ -148,25 +221,18 @@ io_fgetc (io_handle io)
 {
   int r;
 
-  io_fflush (io);
-
  next:
   /* Satify this from the input buffer? */
   if (io->inbuflen > 0)
     {
-      int c = *io->inbufpos;
+      int c = (unsigned char) *io->inbufpos;
       io->inbufpos++;
       io->inbuflen--;
       return c;
     }
 
   /* Refill the input buffer from the socket. */
-  r = pth_read (io->sock, io->inbuf, IOLIB_INPUT_BUFFER_SIZE * sizeof (char));
-  if (r < 0) _err (io, "read");
-
-  io->inbufpos = io->inbuf;
-  io->inbuflen = r;
-  io->inbufcount += r;
+  r = _refill (io);
 
   /* End of buffer? */
   if (r == 0) return -1;
@@ -180,23 +246,33 @@ io_fgets (char *s, int max_size, io_handle io, int store_eol)
 {
   int n = 0;
 
-  io_fflush (io);
-
   while (n < max_size - 1)
     {
-      int c = io_fgetc (io);
+      int i;
+      char *eol;
 
-      /* End of file? */
-      if (c == -1)
+      if (io->inbuflen == 0 && _refill (io) == 0)
 	{
+	  /* End of file. */
 	  s[n] = '\0';
 	  return n > 0 ? s : 0;
 	}
 
-      s[n++] = c;
+      /* Copy up to and including the end of line, or as much as will
+       * fit, straight out of the input buffer.
+       */
+      i = max_size - 1 - n;
+      if (i > io->inbuflen) i = io->inbuflen;
+      eol = memchr (io->inbufpos, '\n', i);
+      if (eol) i = eol - io->inbufpos + 1;
+
+      memcpy (s + n, io->inbufpos, i);
+      n += i;
+      io->inbufpos += i;
+      io->inbuflen -= i;
 
       /* End of line? */
-      if (c == '\n')
+      if (eol)
 	break;
     }
 
@@ -233,8 +309,6 @@ io_fread (void *ptr, size_t size, size_t nmemb, io_handle io)
   int i;
   char *cptr = (char *) ptr;
 
-  io_fflush (io);
-
   /* Satisfy as much as possible from the input buffer. */
   i = n > io->inbuflen ? io->inbuflen : n;
   memcpy (cptr, io->inbufpos, i * sizeof (char));
@@ -244,13 +318,33 @@ io_fread (void *ptr, size_t size, size_t nmemb, io_handle io)
   io->inbuflen -= i;
   io->inbufpos += i;
 
-  /* Read the rest directly from the socket until we have either
-   * satisfied the request or there is an EOF.
+  /* Read the rest from the socket until we have either satisfied the
+   * request or there is an EOF. Large reads go directly into the
+   * caller's buffer, small ones through the input buffer.
    */
   while (n > 0)
     {
-      int r = pth_read (io->sock, cptr, n * sizeof (char));
-      if (r < 0) _err (io, "read");
+      int r;
+
+      if (n >= io->inbufsize)
+	{
+	  io_fflush (io);
+	  r = pth_read (io->sock, cptr, n * sizeof (char));
+	  if (r < 0) _err (io, "read");
+
+	  io->inbufcalls++;
+	  io->inbufcount += r;
+	}
+      else
+	{
+	  if (_refill (io) == 0)
+	    return c;
+
+	  r = n > io->inbuflen ? io->inbuflen : n;
+	  memcpy (cptr, io->inbufpos, r * sizeof (char));
+	  io->inbuflen -= r;
+	  io->inbufpos += r;
+	}
 
       if (r == 0)		/* End of file. */
 	return c;
@@ -258,7 +352,6 @@ io_fread (void *ptr, size_t size, size_t nmemb, io_handle io)
       n -= r;
       c += r;
       cptr += r;
-      io->inbufcount += r;
     }
 
   return c;
@@ -283,17 +376,41 @@ io_fputc (int c, io_handle io)
     }
 
   /* We need to flush the output buffer and try again. */
-  _flush (io, 0);
+  _output_buffer_full (io);
+  if (io->outbuffree == 0)
+    _flush (io, 0);
   goto again;
 }
 
 int
 io_fputs (const char *s, io_handle io)
 {
-  while (*s)
+  size_t n = strlen (s);
+
+  if (n > io->outbuffree)
+    _output_buffer_full (io);
+
+  if (n <= io->outbuffree)
+    {
+      memcpy (io->outbufpos, s, n);
+      io->outbufpos += n;
+      io->outbuffree -= n;
+
+      /* Flush the buffer after each character or line. */
+      if (io->outbufmode == IO_MODE_UNBUFFERED ||
+	  (io->outbufmode == IO_MODE_LINE_BUFFERED && memchr (s, '\n', n)))
+	_flush (io, 0);
+    }
+  else
     {
-      io_fputc (*s, io);
-      s++;
+      /* Too big for the buffer, so write the buffer and the string out
+       * together.
+       */
+      struct iovec iov;
+
+      iov.iov_base = (void *) s;
+      iov.iov_len = n;
+      _flushv (io, &iov, 1, 0);
     }
 
   /* According to the manual page, fputs returns a non-negative number
@@ -342,20 +459,114 @@ io_fprintf (io_handle io, const char *fs, ...)
 size_t
 io_fwrite (const void *ptr, size_t size, size_t nmemb, io_handle io)
 {
-  size_t n = size * nmemb, c = 0;
-  char *cptr = (char *) ptr;
+  struct iovec iov;
+
+  iov.iov_base = (void *) ptr;
+  iov.iov_len = size * nmemb;
+  return io_writev (io, &iov, 1);
+}
+
+size_t
+io_writev (io_handle io, const struct iovec *iov, int iovcnt)
+{
+  size_t n = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; ++i)
+    n += iov[i].iov_len;
+
+  if (n > io->outbuffree)
+    _output_buffer_full (io);
+
+  /* If the output is fully buffered and the data fits, copy it into
+   * the buffer.
+   */
+  if (io->outbufmode == IO_MODE_FULLY_BUFFERED && n <= io->outbuffree)
+    {
+      for (i = 0; i < iovcnt; ++i)
+	{
+	  memcpy (io->outbufpos, iov[i].iov_base, iov[i].iov_len);
+	  io->outbufpos += iov[i].iov_len;
+	}
+      io->outbuffree -= n;
+      return n;
+    }
+
+  /* Otherwise write any buffered data and the new data directly to the
+   * socket in one system call.
+   */
+  _flushv (io, iov, iovcnt, 0);
+  return n;
+}
 
-  /* Flush out any existing data. */
+/* Copy a file to the socket by reading and writing it, for when we
+ * can't use sendfile.
+ */
+static size_t
+_copy_file (io_handle io, int fd, off_t offset, size_t len)
+{
+  const int n = 8192;
+  char *buffer = alloca (n);
+  size_t c = 0;
+
+  if (buffer == 0) abort ();
+
+  while (len > 0)
+    {
+      int r = pread (fd, buffer, len > n ? n : len, offset);
+      if (r < 0) _err (io, "pread");
+      if (r == 0)		/* End of file. */
+	break;
+
+      io_fwrite (buffer, 1, r, io);
+      offset += r;
+      len -= r;
+      c += r;
+    }
+
+  return c;
+}
+
+size_t
+io_sendfile (io_handle io, int fd, off_t offset, size_t len)
+{
+  size_t c = 0;
+
+  /* If the file is small enough to fit in the output buffer, read it
+   * straight in. This saves a system call, and means that replies to
+   * pipelined requests can still go out in a single write.
+   */
+  if (io->outbufmode == IO_MODE_FULLY_BUFFERED && len <= io->outbuffree)
+    {
+      int r = pread (fd, io->outbufpos, len, offset);
+      if (r < 0) _err (io, "pread");
+
+      io->outbufpos += r;
+      io->outbuffree -= r;
+      return r;
+    }
+
+  /* Flush out any existing data (eg. HTTP headers). */
   io_fflush (io);
 
-  /* Write the data directly to the socket. */
-  while (n > 0)
+  while (len > 0)
     {
-      int r = pth_write (io->sock, cptr, n * sizeof (char));
-      if (r < 0) _err (io, "write");
+      ssize_t r = pth_sendfile (io->sock, fd, &offset, len);
+      io->outbufcalls++;
+      if (r < 0)
+	{
+	  /* No sendfile, or it can't send from this file. */
+	  if (c == 0 &&
+	      (errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+	    return _copy_file (io, fd, offset, len);
 
-      n -= r;
-      cptr += r;
+	  _err (io, "sendfile");
+	}
+
+      if (r == 0)		/* End of file. */
+	break;
+
+      len -= r;
       c += r;
       io->outbufcount += r;
     }
@@ -505,13 +716,36 @@ io_setbufmode (io_handle io, int mode)
 static void
 _flush (io_handle io, int ignore_errors)
 {
-  size_t n = io->outbufpos - io->outbuf;
-  char *cptr = io->outbuf;
+  _flushv (io, 0, 0, ignore_errors);
+}
+
+/* Write the output buffer followed by the data in iov to the socket,
+ * using as few system calls as possible.
+ */
+static void
+_flushv (io_handle io, const struct iovec *iov, int iovcnt,
+	 int ignore_errors)
+{
+  struct iovec *v = alloca ((iovcnt + 1) * sizeof (struct iovec));
+  int n = 0, i;
+
+  if (v == 0) abort ();
+
+  if (io->outbufpos > io->outbuf)
+    {
+      v[n].iov_base = io->outbuf;
+      v[n].iov_len = io->outbufpos - io->outbuf;
+      n++;
+    }
+  for (i = 0; i < iovcnt; ++i)
+    if (iov[i].iov_len > 0)
+      v[n++] = iov[i];
 
   /* Write the data to the socket. */
   while (n > 0)
     {
-      int r = pth_write (io->sock, cptr, n * sizeof (char));
+      int r = pth_writev (io->sock, v, n > IOV_MAX ? IOV_MAX : n);
+      io->outbufcalls++;
       if (r < 0)
 	{
 	  if (!ignore_errors)
@@ -520,14 +754,133 @@ _flush (io_handle io, int ignore_errors)
 	    break;
 	}
 
-      n -= r;
-      cptr += r;
       io->outbufcount += r;
+
+      /* Skip over the data which was written. */
+      while (n > 0 && r >= v->iov_len)
+	{
+	  r -= v->iov_len;
+	  v++;
+	  n--;
+	}
+      if (n > 0)
+	{
+	  v->iov_base = (char *) v->iov_base + r;
+	  v->iov_len -= r;
+	}
     }
 
   /* Reset the output buffer. */
   io->outbufpos = io->outbuf;
-  io->outbuffree = IOLIB_OUTPUT_BUFFER_SIZE;
+  io->outbuffree = io->outbufsize;
+}
+
+/* Refill the (empty) input buffer from the socket. Returns the number
+ * of bytes read, or 0 at end of file.
+ *
+ * Output is only flushed here, just before we might block waiting for
+ * input, and not on every read. So if a client sends several requests
+ * at once, all the replies are buffered up and sent together.
+ */
+static int
+_refill (io_handle io)
+{
+  int r;
+
+  io_fflush (io);
+
+  /* In adaptive mode, grow the input buffer if it keeps filling up. */
+  if (io->inbuffills >= ADAPTIVE_NR_FILLS && io->inbufsize < io->maxbufsize)
+    {
+      io->inbufsize *= 2;
+      if (io->inbufsize > io->maxbufsize) io->inbufsize = io->maxbufsize;
+      io->inbuf = prealloc (io->pool, io->inbuf, io->inbufsize);
+      io->inbuffills = 0;
+    }
+
+  r = pth_read (io->sock, io->inbuf, io->inbufsize * sizeof (char));
+  if (r < 0) _err (io, "read");
+
+  io->inbufpos = io->inbuf;
+  io->inbuflen = r;
+  io->inbufcount += r;
+  io->inbufcalls++;
+  if (r == io->inbufsize)
+    io->inbuffills++;
+  else
+    io->inbuffills = 0;
+
+  return r;
+}
+
+/* Called when data doesn't fit into the output buffer. In adaptive
+ * mode, if this happens repeatedly (without an explicit flush in
+ * between) then grow the buffer.
+ */
+static void
+_output_buffer_full (io_handle io)
+{
+  int used;
+
+  if (io->outbufsize >= io->maxbufsize) return;
+
+  if (++io->outbuffills < ADAPTIVE_NR_FILLS) return;
+
+  used = io->outbufpos - io->outbuf;
+  io->outbufsize *= 2;
+  if (io->outbufsize > io->maxbufsize) io->outbufsize = io->maxbufsize;
+  io->outbuf = prealloc (io->pool, io->outbuf, io->outbufsize);
+  io->outbufpos = io->outbuf + used;
+  io->outbuffree = io->outbufsize - used;
+  io->outbuffills = 0;
+}
+
+void
+io_setbufsize (io_handle io, int inbufsize, int outbufsize)
+{
+  if (inbufsize > 0)
+    {
+      /* Keep any unread data at the end of the new buffer. */
+      if (inbufsize < io->inbuflen) inbufsize = io->inbuflen;
+      memmove (io->inbuf, io->inbufpos, io->inbuflen);
+      io->inbuf = prealloc (io->pool, io->inbuf, inbufsize);
+      io->inbufsize = inbufsize;
+      memmove (io->inbuf + inbufsize - io->inbuflen, io->inbuf, io->inbuflen);
+      io->inbufpos = io->inbuf + inbufsize - io->inbuflen;
+    }
+
+  if (outbufsize > 0)
+    {
+      int used;
+
+      if (io->outbufpos - io->outbuf > outbufsize)
+	_flush (io, 0);
+
+      used = io->outbufpos - io->outbuf;
+      io->outbuf = prealloc (io->pool, io->outbuf, outbufsize);
+      io->outbufsize = outbufsize;
+      io->outbufpos = io->outbuf + used;
+      io->outbuffree = outbufsize - used;
+    }
+}
+
+void
+io_setbufadaptive (io_handle io, int max_size)
+{
+  io->maxbufsize = max_size;
+  io->inbuffills = io->outbuffills = 0;
+}
+
+int
+io_get_inbufsize (io_handle io)
+{
+  return io->inbufsize;
+}
+
+int
+io_get_outbufsize (io_handle io)
+{
+  return io->outbufsize;
 }
 
 int
@@ -536,6 +889,38 @@ io_fileno (io_handle io)
   return io->sock;
 }
 
+const char *
+io_get_peername (io_handle io, int *port)
+{
+  if (!io->peer_known)
+    {
+      struct sockaddr_in addr;
+      socklen_t addrlen = sizeof addr;
+
+      if (getpeername (io->sock, (struct sockaddr *) &addr, &addrlen) == 0
+	  && addr.sin_family == AF_INET)
+	{
+	  strcpy (io->peer_addr, inet_ntoa (addr.sin_addr));
+	  io->peer_port = ntohs (addr.sin_port);
+	}
+      else
+	{
+	  strcpy (io->peer_addr, "-");
+	  io->peer_port = 0;
+	}
+      io->peer_known = 1;
+    }
+
+  if (port) *port = io->peer_port;
+  return io->peer_addr;
+}
+
+int
+io_get_inbuflen (io_handle io)
+{
+  return io->inbuflen;
+}
+
 int
 io_get_inbufcount (io_handle io)
 {
@@ -548,6 +933,18 @@ io_get_outbufcount (io_handle io)
   return io->outbufcount;
 }
 
+int
+io_get_inbufcalls (io_handle io)
+{
+  return io->inbufcalls;
+}
+
+int
+io_get_outbufcalls (io_handle io)
+{
+  return io->outbufcalls;
+}
+
 static void
 _err (io_handle io, const char *msg)
 {
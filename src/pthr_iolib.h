@@ -26,6 +26,8 @@
 
 #include <setjmp.h>
 
+#include <sys/uio.h>
+
 #include <pool.h>
 
 #include "pthr_pseudothread.h"
@@ -42,6 +44,7 @@ typedef struct io_handle *io_handle;
 #define IO_MODE_FULLY_BUFFERED 2
 
 /* Function: io_fdopen - A buffered I/O library
+ * Function: io_fdopen_with_bufsize
  * Function: io_fclose
  * Function: io_fgetc
  * Function: io_fgets
@@ -51,14 +54,24 @@ typedef struct io_handle *io_handle;
  * Function: io_fputs
  * Function: io_fprintf
  * Function: io_fwrite
+ * Function: io_writev
+ * Function: io_sendfile
  * Function: io_fflush
  * Function: io_fileno
+ * Function: io_get_peername
  * Function: io_popen
  * Function: io_pclose
  * Function: io_copy
  * Function: io_setbufmode
+ * Function: io_setbufsize
+ * Function: io_setbufadaptive
+ * Function: io_get_inbufsize
+ * Function: io_get_outbufsize
+ * Function: io_get_inbuflen
  * Function: io_get_inbufcount
  * Function: io_get_outbufcount
+ * Function: io_get_inbufcalls
+ * Function: io_get_outbufcalls
  *
  * The @code{io_*} functions replace the normal blocking C library
  * @code{f*} functions with equivalents which work on non-blocking
@@ -74,6 +87,11 @@ typedef struct io_handle *io_handle;
  * or @code{io_fclose} is called, the underlying socket is
  * closed (with @ref{close(2)}).
  *
+ * @code{io_fdopen_with_bufsize} is the same, but sets the sizes of
+ * the input and output buffers (the defaults are
+ * @code{IOLIB_INPUT_BUFFER_SIZE} and @code{IOLIB_OUTPUT_BUFFER_SIZE},
+ * which are both 1 KByte). A size of 0 means use the default.
+ *
  * @code{io_fclose} flushes all unwritten data out of the socket
  * and closes it.
  *
@@ -83,6 +101,37 @@ typedef struct io_handle *io_handle;
  * false, then the end of line characters (@code{CR}, @code{CR LF}
  * or @code{LF}) are stripped from the string before it is stored.
  *
+ * Reading does not flush the output buffer unless there is no
+ * buffered input left and the handle has to wait for more. So if
+ * the other end sends several requests at once, the replies are
+ * sent together in a single write. @code{io_get_inbuflen} returns
+ * the number of bytes of input which are buffered and not yet read.
+ *
+ * @code{io_writev} writes the data described by @code{iovcnt}
+ * @code{struct iovec} elements (see @ref{writev(2)}) and returns the
+ * total number of bytes written. If the handle is fully buffered and
+ * the data fits in the buffer, it is copied there. Otherwise the
+ * buffered data and the new data are written out together in a
+ * single system call, without copying the new data. @code{io_fwrite}
+ * behaves in the same way.
+ *
+ * @code{io_sendfile} sends @code{len} bytes of the file @code{fd},
+ * starting at @code{offset}, to the socket. If the data fits in
+ * the output buffer it is simply read into it. Otherwise any
+ * buffered output is flushed first, and where possible the data
+ * is sent by the kernel (see @ref{pth_sendfile(3)}) without being
+ * copied through the program; otherwise the file is read and
+ * written in the ordinary way. @code{fd} must be an ordinary file,
+ * and its file position is not changed. The number of bytes sent
+ * is returned, which is less than @code{len} only if the end of
+ * the file is reached.
+ *
+ * @code{io_get_peername} returns the address of the other end of
+ * the socket as a string, and stores the port number in
+ * @code{*port} (if @code{port} is not @code{NULL}). The address
+ * is only looked up once for each handle. If the socket is not
+ * connected to an IPv4 peer, the address returned is @code{"-"}.
+ *
  * @code{io_copy} copies @code{len} bytes from @code{from_io}
  * to @code{to_io}. If @code{len} equals -1 then bytes are
  * copied from @code{from_io} until end of file is reached.
@@ -96,9 +145,25 @@ typedef struct io_handle *io_handle;
  * @code{IO_MODE_FULLY_BUFFERED}, and these correspond to line
  * buffering, no buffering and full (block) buffering.
  *
+ * @code{io_setbufsize} changes the size of the input and output
+ * buffers. Either size may be 0 to leave that buffer alone. Data
+ * already in the buffers is kept.
+ *
+ * @code{io_setbufadaptive} turns on adaptive buffer sizing: each
+ * buffer is doubled in size whenever it fills up twice in a row, up
+ * to a maximum of @code{max_size} bytes. So a handle which only
+ * deals with short requests and responses keeps small buffers, but
+ * one which is sending or receiving a lot of data makes fewer, larger
+ * system calls. A @code{max_size} of 0 turns adaptive sizing off.
+ * The buffers never shrink. @code{io_get_inbufsize} and
+ * @code{io_get_outbufsize} return the current buffer sizes.
+ *
  * @code{io_get_inbufcount} and @code{io_get_outbufcount} return
  * the number of characters read and written on the socket since
  * the socket was associated with the I/O object.
+ * @code{io_get_inbufcalls} and @code{io_get_outbufcalls} return
+ * the number of system calls used to do it, which is useful when
+ * tuning buffer sizes.
  *
  * See also:
  * @ref{fgetc(3)},
@@ -116,6 +181,7 @@ typedef struct io_handle *io_handle;
  * @ref{pth_exit(3)}.
  */
 extern io_handle io_fdopen (int sock);
+extern io_handle io_fdopen_with_bufsize (int sock, int inbufsize, int outbufsize);
 extern void io_fclose (io_handle);
 extern int io_fgetc (io_handle);
 extern char *io_fgets (char *s, int max_size, io_handle, int store_eol);
@@ -125,13 +191,23 @@ extern int io_fputc (int c, io_handle);
 extern int io_fputs (const char *s, io_handle);
 extern int io_fprintf (io_handle, const char *fs, ...) __attribute__ ((format (printf, 2, 3)));
 extern size_t io_fwrite (const void *ptr, size_t size, size_t nmemb, io_handle);
+extern size_t io_writev (io_handle, const struct iovec *iov, int iovcnt);
+extern size_t io_sendfile (io_handle, int fd, off_t offset, size_t len);
 extern int io_fflush (io_handle);
 extern int io_fileno (io_handle);
+extern const char *io_get_peername (io_handle, int *port);
 extern io_handle io_popen (const char *command, const char *mode);
 extern void io_pclose (io_handle);
 extern int io_copy (io_handle from_io, io_handle to_io, int len);
 extern void io_setbufmode (io_handle, int mode);
+extern void io_setbufsize (io_handle, int inbufsize, int outbufsize);
+extern void io_setbufadaptive (io_handle, int max_size);
+extern int io_get_inbufsize (io_handle);
+extern int io_get_outbufsize (io_handle);
+extern int io_get_inbuflen (io_handle);
 extern int io_get_inbufcount (io_handle);
 extern int io_get_outbufcount (io_handle);
+extern int io_get_inbufcalls (io_handle);
+extern int io_get_outbufcalls (io_handle);
 
 #endif /* PTHR_IOLIB_H */
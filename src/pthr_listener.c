@@ -19,6 +19,10 @@
 
 #include "config.h"
 
+#ifdef HAVE_ACCEPT4
+#define _GNU_SOURCE		/* For accept4. */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -30,6 +34,10 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
@@ -47,6 +55,7 @@
 #endif
 
 #include "pthr_pseudothread.h"
+#include "pthr_wait_queue.h"
 #include "pthr_listener.h"
 
 struct listener
@@ -55,9 +64,39 @@ struct listener
   int sock;
   void (*processor_fn) (int sock, void *data);
   void *data;
+
+  /* Admission control. */
+  int max_connections;		/* Maximum connections, or 0 = no limit. */
+  int nr_connections;		/* Number of connections running now. */
+  wait_queue accept_wq;		/* Listener sleeps here while paused. */
+
+  /* Connections accepted but not yet started. */
+  int *queue;			/* Ring buffer of sockets. */
+  int queue_size, queue_head, queue_len;
+  int queue_mode;		/* LISTENER_FIFO or LISTENER_LIFO. */
+  int nr_dropped;		/* Connections dropped from a full queue. */
+  pseudothread dispatcher;	/* Starts queued connections. */
+  wait_queue dispatch_wq;	/* Dispatcher sleeps here. */
 };
 
+static int accept_batch = 16;
+
 static void run (void *vp);
+static void run_dispatcher (void *vp);
+static int accept_nonblocking (int sock);
+static void start_connection (listener p, int sock);
+
+int
+listener_set_accept_batch (int n)
+{
+  return accept_batch = n > 0 ? n : 1;
+}
+
+int
+listener_get_accept_batch (void)
+{
+  return accept_batch;
+}
 
 listener
 new_listener (int sock,
@@ -72,6 +111,15 @@ new_listener (int sock,
   p->sock = sock;
   p->processor_fn = processor_fn;
   p->data = data;
+  p->max_connections = 0;
+  p->nr_connections = 0;
+  p->accept_wq = new_wait_queue (pool);
+  p->queue = 0;
+  p->queue_size = p->queue_head = p->queue_len = 0;
+  p->queue_mode = LISTENER_FIFO;
+  p->nr_dropped = 0;
+  p->dispatcher = 0;
+  p->dispatch_wq = new_wait_queue (pool);
   p->pth = new_pseudothread (pool, run, p, "listener");
 
   pth_start (p->pth);
@@ -79,26 +127,256 @@ new_listener (int sock,
   return p;
 }
 
+void
+listener_set_max_connections (listener p, int max_connections)
+{
+  p->max_connections = max_connections > 0 ? max_connections : 0;
+
+  /* The limit may have been raised, so let the threads look again. */
+  wq_wake_up (p->accept_wq);
+  wq_wake_up (p->dispatch_wq);
+}
+
+void
+listener_set_queue (listener p, int size, int mode)
+{
+  pool pool = pth_get_pool (p->pth);
+  int *queue = 0, i;
+
+  if (size < p->queue_len) size = p->queue_len;
+  if (size > 0)
+    {
+      queue = pmalloc (pool, size * sizeof (int));
+      for (i = 0; i < p->queue_len; ++i)
+	queue[i] = p->queue[(p->queue_head + i) % p->queue_size];
+    }
+
+  p->queue = queue;
+  p->queue_size = size;
+  p->queue_head = 0;
+  p->queue_mode = mode;
+
+  if (size > 0 && !p->dispatcher)
+    {
+      p->dispatcher = new_pseudothread (new_pool (), run_dispatcher, p,
+					"listener dispatcher");
+      pth_start (p->dispatcher);
+    }
+}
+
+int
+listener_get_nr_connections (listener p)
+{
+  return p->nr_connections;
+}
+
+int
+listener_get_nr_queued (listener p)
+{
+  return p->queue_len;
+}
+
+int
+listener_get_nr_dropped (listener p)
+{
+  return p->nr_dropped;
+}
+
+static inline int
+have_room (listener p)
+{
+  return p->max_connections == 0 || p->nr_connections < p->max_connections;
+}
+
+/* Should the listener stop accepting connections for the moment? If
+ * so, it stops polling the listening socket, and new connections wait
+ * in the kernel's listen queue. A LIFO queue never fills up, since the
+ * oldest connection is dropped instead.
+ */
+static inline int
+paused (listener p)
+{
+  return !have_room (p) &&
+    (p->queue_size == 0 ||
+     (p->queue_mode == LISTENER_FIFO && p->queue_len == p->queue_size));
+}
+
+static void
+enqueue (listener p, int sock)
+{
+  if (p->queue_len == p->queue_size)
+    {
+      /* LIFO: drop the oldest connection, which has waited longest and
+       * whose client has most probably given up already.
+       */
+      close (p->queue[p->queue_head]);
+      p->queue_head = (p->queue_head + 1) % p->queue_size;
+      p->queue_len--;
+      p->nr_dropped++;
+    }
+
+  p->queue[(p->queue_head + p->queue_len) % p->queue_size] = sock;
+  p->queue_len++;
+}
+
+static int
+dequeue (listener p)
+{
+  int sock;
+
+  if (p->queue_mode == LISTENER_LIFO)
+    sock = p->queue[(p->queue_head + p->queue_len - 1) % p->queue_size];
+  else
+    {
+      sock = p->queue[p->queue_head];
+      p->queue_head = (p->queue_head + 1) % p->queue_size;
+    }
+  p->queue_len--;
+
+  return sock;
+}
+
+/* Called when the thread handling a connection exits. */
+static void
+connection_done (void *vp)
+{
+  listener p = (listener) vp;
+
+  p->nr_connections--;
+
+  if (p->queue_len > 0)
+    wq_wake_up (p->dispatch_wq);
+  else if (wq_nr_sleepers (p->accept_wq) > 0)
+    wq_wake_up (p->accept_wq);
+}
+
+/* Called when processor_fn creates a thread. Only the first thread
+ * it creates is counted as the connection.
+ */
+static void
+count_connection (pseudothread pth, void *vp)
+{
+  listener p = (listener) vp;
+
+  _pth_set_spawn_hook (0, 0);
+  p->nr_connections++;
+  pool_register_cleanup_fn (pth_get_pool (pth), connection_done, p);
+}
+
+static void
+start_connection (listener p, int sock)
+{
+  _pth_set_spawn_hook (count_connection, p);
+  p->processor_fn (sock, p->data);
+  _pth_set_spawn_hook (0, 0);
+}
+
+static void
+run_dispatcher (void *vp)
+{
+  listener p = (listener) vp;
+
+  for (;;)
+    {
+      while (p->queue_len > 0 && have_room (p))
+	start_connection (p, dequeue (p));
+
+      /* There is space in the queue again. */
+      if (wq_nr_sleepers (p->accept_wq) > 0)
+	wq_wake_up (p->accept_wq);
+
+      wq_sleep_on (p->dispatch_wq);
+    }
+}
+
 static void
 run (void *vp)
 {
   listener p = (listener) vp;
+  int i, ns = -1;
 
   for (;;)
     {
-      struct sockaddr_in addr;
-      int sz, ns;
+      /* Accept all the connections which are waiting, up to a limit,
+       * before going back to the reactor.
+       */
+      for (i = 0; i < accept_batch && !paused (p); ++i)
+	{
+	  ns = accept_nonblocking (p->sock);
+	  if (ns == -1)
+	    break;
+
+	  /* Create a new processor thread to handle this connection,
+	   * or queue it if there are too many running already.
+	   */
+	  if (have_room (p) && p->queue_len == 0)
+	    start_connection (p, ns);
+	  else
+	    {
+	      enqueue (p, ns);
+	      if (have_room (p))
+		wq_wake_up (p->dispatch_wq);
+	    }
+	}
+
+      if (paused (p))
+	{
+	  /* Wait for a connection to finish. */
+	  while (paused (p))
+	    wq_sleep_on (p->accept_wq);
+	  continue;
+	}
 
-      /* Wait for the new connection. */
-      sz = sizeof addr;
-      ns = pth_accept (p->sock, (struct sockaddr *) &addr, &sz);
+      if (ns >= 0)
+	/* Let the other threads run before accepting any more. */
+	pth_millisleep (0);
+      else if (errno == EWOULDBLOCK || errno == EAGAIN)
+	/* Wait for the next connection. */
+	pth_wait_readable (p->sock);
+      else
+	{
+	  /* Probably out of file descriptors. Back off for a while,
+	   * rather than spinning on the listening socket.
+	   */
+	  perror ("accept");
+	  pth_millisleep (100);
+	}
+    }
+}
 
-      if (ns < 0) { perror ("accept"); continue; }
+/* Accept a connection on the (non-blocking) listening socket, returning
+ * a new non-blocking socket, or -1 if there are no more connections
+ * waiting or there was an error.
+ */
+static int
+accept_nonblocking (int sock)
+{
+  struct sockaddr_in addr;
+  socklen_t sz;
+  int ns;
 
-      /* Set the new socket to non-blocking. */
-      if (fcntl (ns, F_SETFL, O_NONBLOCK) < 0) abort ();
+ again:
+  sz = sizeof addr;
+#ifdef HAVE_ACCEPT4
+  ns = accept4 (sock, (struct sockaddr *) &addr, &sz,
+		SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  ns = accept (sock, (struct sockaddr *) &addr, &sz);
+#endif
 
-      /* Create a new processor thread to handle this connection. */
-      p->processor_fn (ns, p->data);
+  if (ns == -1)
+    {
+      /* The client went away before we accepted it. */
+      if (errno == EINTR || errno == ECONNABORTED)
+	goto again;
+      return -1;
     }
+
+#ifndef HAVE_ACCEPT4
+  /* Set the new socket to non-blocking. */
+  if (fcntl (ns, F_SETFL, O_NONBLOCK) < 0) abort ();
+  if (fcntl (ns, F_SETFD, FD_CLOEXEC) < 0) abort ();
+#endif
+
+  return ns;
 }
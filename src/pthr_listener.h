@@ -26,6 +26,73 @@
 struct listener;
 typedef struct listener *listener;
 
+/* Function: new_listener - Create a thread to accept connections.
+ * Function: listener_set_accept_batch
+ * Function: listener_get_accept_batch
+ *
+ * @code{new_listener} starts a new thread which accepts connections
+ * on the listening socket @code{sock} (which must be non-blocking).
+ * For each connection, it calls @code{processor_fn} with the new
+ * socket, which has already been set to non-blocking, and
+ * @code{data}. Usually @code{processor_fn} creates a new thread to
+ * handle the connection.
+ *
+ * When the listening socket becomes readable, the listener accepts
+ * all waiting connections, up to the accept batch size (default: 16),
+ * before waiting again. @code{listener_set_accept_batch} changes
+ * this. A larger batch copes better with bursts of new connections,
+ * a smaller one gives existing connections more of a chance to run
+ * in between.
+ *
+ * See also: @ref{pthr_server_main_loop(3)}, @ref{listener_set_max_connections(3)}.
+ */
 extern listener new_listener (int sock, void (*processor_fn) (int sock, void *data), void *data);
+extern int listener_set_accept_batch (int n);
+extern int listener_get_accept_batch (void);
+
+#define LISTENER_FIFO 0
+#define LISTENER_LIFO 1
+
+/* Function: listener_set_max_connections - Limit the number of connections.
+ * Function: listener_set_queue
+ * Function: listener_get_nr_connections
+ * Function: listener_get_nr_queued
+ * Function: listener_get_nr_dropped
+ *
+ * Without a limit, a sudden burst of connections creates a thread (and
+ * a stack) for each one, and every connection slows down together.
+ * @code{listener_set_max_connections} limits the number of connections
+ * which run at the same time (0 means no limit, the default). A
+ * connection is counted from when @code{processor_fn} creates its
+ * thread until that thread exits. Only the first thread created by
+ * each call to @code{processor_fn} is counted, and
+ * @code{processor_fn} should not block.
+ *
+ * When the limit is reached, the listener stops accepting connections,
+ * and new connections wait in the kernel (see
+ * @ref{pthr_server_listen_backlog(3)}) until a running connection
+ * finishes.
+ *
+ * @code{listener_set_queue} makes the listener carry on accepting
+ * connections when the limit is reached, and hold up to @code{size}
+ * of them itself until they can be started. With @code{LISTENER_FIFO}
+ * they are started in the order that they arrived, and the listener
+ * stops accepting when the queue is full. With @code{LISTENER_LIFO}
+ * the newest connection is started first, and when the queue is full
+ * the oldest connection is closed to make room. Under overload this
+ * serves the clients which are most likely to still be waiting for
+ * an answer, instead of serving all of them too late. This should be
+ * called just after @code{new_listener}.
+ *
+ * @code{listener_get_nr_connections}, @code{listener_get_nr_queued}
+ * and @code{listener_get_nr_dropped} return the number of connections
+ * running now, waiting in the queue, and dropped because the queue
+ * was full.
+ */
+extern void listener_set_max_connections (listener, int max_connections);
+extern void listener_set_queue (listener, int size, int mode);
+extern int listener_get_nr_connections (listener);
+extern int listener_get_nr_queued (listener);
+extern int listener_get_nr_dropped (listener);
 
 #endif /* PTHR_LISTENER_H */
@@ -0,0 +1,196 @@
+/* Convert binary HTTP logs to text.
+ * Copyright (C) 2003 Richard W.M. Jones <rich@annexia.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+/* Usage: pthr_logconv [-l] [file ...]
+ *
+ * Reads binary logs written by the HTTP library (see
+ * http_set_log_format(3)) from the files named, or from standard input,
+ * and prints them in the usual text format. With -l, the latency of
+ * each request (in milliseconds) is appended to each line.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#include <pool.h>
+#include <hash.h>
+#include <pstring.h>
+
+#include "pthr_http.h"
+
+/* Strings are numbered separately by each process. */
+struct string_key
+{
+  unsigned int pid;
+  unsigned int id;
+};
+
+static hash strings;
+static int print_latency = 0;
+
+static const char *
+get_string (unsigned int pid, unsigned int id)
+{
+  struct string_key key;
+  const char *str;
+
+  if (id == 0) return "-";
+
+  memset (&key, 0, sizeof key);
+  key.pid = pid;
+  key.id = id;
+  if (!hash_get (strings, key, str))
+    return "?";			/* Defined in an earlier log file. */
+  return str;
+}
+
+static const char *
+method_string (int method)
+{
+  switch (method)
+    {
+    case HTTP_METHOD_GET: return "GET";
+    case HTTP_METHOD_HEAD: return "HEAD";
+    case HTTP_METHOD_POST: return "POST";
+    }
+  return "?";
+}
+
+static void
+print_request (const struct http_log_request *r)
+{
+  char time_str[64];
+  time_t t = r->time;
+
+#if HAVE_STRFTIME && HAVE_GMTIME
+  strftime (time_str, sizeof time_str, "%Y/%m/%d %H:%M:%S", gmtime (&t));
+#else
+  strcpy (time_str, "- -");
+#endif
+
+  printf ("%s %s:%d \"%s %s HTTP/%d.%d\" %d %d \"%s\" \"%s\"",
+	  time_str, get_string (r->pid, r->peer), r->port,
+	  method_string (r->method), get_string (r->pid, r->url),
+	  r->major, r->minor, r->code, r->length,
+	  get_string (r->pid, r->referer), get_string (r->pid, r->user_agent));
+  if (print_latency)
+    printf (" %u", r->latency);
+  printf ("\n");
+}
+
+static int
+convert (const char *filename, FILE *fp)
+{
+  union
+  {
+    struct http_log_request request;
+    struct http_log_string string;
+    char buffer[65536];
+  } r;
+  unsigned short len;
+
+  while (fread (&len, sizeof len, 1, fp) == 1)
+    {
+      if (len < sizeof (struct http_log_string))
+	goto bad;
+
+      memcpy (r.buffer, &len, sizeof len);
+      if (fread (r.buffer + sizeof len, len - sizeof len, 1, fp) != 1)
+	goto bad;
+
+      switch (r.request.type)
+	{
+	case HTTP_LOG_REQUEST:
+	  if (len < sizeof (struct http_log_request))
+	    goto bad;
+	  print_request (&r.request);
+	  break;
+
+	case HTTP_LOG_STRING:
+	  {
+	    struct string_key key;
+	    char *str;
+
+	    memset (&key, 0, sizeof key);
+	    key.pid = r.string.pid;
+	    key.id = r.string.id;
+	    str = pstrndup (global_pool, r.buffer + sizeof r.string,
+			    len - sizeof r.string);
+	    hash_insert (strings, key, str);
+	    break;
+	  }
+
+	default:
+	  goto bad;
+	}
+    }
+
+  return 0;
+
+ bad:
+  fprintf (stderr, "pthr_logconv: %s: not a binary HTTP log, or truncated\n",
+	   filename);
+  return -1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int i, r = 0;
+
+  strings = new_hash (global_pool, struct string_key, char *);
+
+  if (argc > 1 && strcmp (argv[1], "-l") == 0)
+    {
+      print_latency = 1;
+      argc--;
+      argv++;
+    }
+
+  if (argc <= 1)
+    r = convert ("stdin", stdin);
+  else
+    for (i = 1; i < argc; ++i)
+      {
+	FILE *fp = fopen (argv[i], "r");
+
+	if (fp == 0)
+	  {
+	    perror (argv[i]);
+	    r = -1;
+	    continue;
+	  }
+	if (convert (argv[i], fp) == -1)
+	  r = -1;
+	fclose (fp);
+      }
+
+  exit (r == 0 ? 0 : 1);
+}
@@ -54,6 +54,14 @@
 #include <sys/time.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
 #include <pool.h>
 #include <vector.h>
 #include <pstring.h>
@@ -71,10 +79,19 @@ struct pseudothread
   /* Thread number. */
   int n;
 
+  /* List of live threads. */
+  struct pseudothread *prev_live, *next_live;
+
   /* Pointer to thread stack and size. */
   void *stack;
   int stack_size;
 
+  /* Stack high water mark. This is only set in the copies returned by
+   * pseudothread_get_threads, after the thread may have gone away.
+   * In real threads it is -1, meaning work it out from the stack.
+   */
+  int stack_hwm;
+
   /* Alarm handling. */
   int alarm_received;
   reactor_timer alarm_timer;
@@ -108,17 +125,47 @@ struct pseudothread
    * variable is unset in the thread.
    */
   const char *tz;
+
+  /* Set if this thread may be kept as an idle worker when it exits
+   * (see pseudothread_set_idle_workers). Such threads are allocated
+   * with malloc, since they outlive their pool.
+   */
+  int worker;
+  struct pseudothread *next_idle;
 };
 
 /* Currently running pseudothread. */
 pseudothread current_pth = 0;
 
-/* Global list of threads. */
-static vector threads = 0;
+/* Global list of live threads, in order of creation. */
+static pseudothread live_head = 0, live_tail = 0;
+static int nr_threads = 0;
+
+/* Thread numbers which are free to be reused, and the next number
+ * which has never been used.
+ */
+static vector free_slots = 0;
+static int next_slot = 0;
 
 /* Default stack size, in bytes. */
 static int default_stack_size = 65536;
 
+/* Idle workers: finished threads which have kept their stack and
+ * context, waiting to be given another run function.
+ */
+static pseudothread idle_workers = 0;
+static int nr_idle = 0, min_idle = 0, max_idle = 0;
+
+/* Scheduled on the reactor run queue to bring the number of idle
+ * workers back up to min_idle, outside the thread which took them.
+ */
+static void refill_idle_workers (void *);
+static struct reactor_runnable refill = { 0, 0, refill_idle_workers, 0 };
+
+/* Called whenever a thread is created (see _pth_set_spawn_hook). */
+static void (*spawn_hook) (pseudothread, void *) = 0;
+static void *spawn_hook_data = 0;
+
 static void block (int sock, int ops);
 static void return_from_block (int sock, int events, void *);
 static void _sleep (int timeout);
@@ -129,6 +176,8 @@ static void return_from_poll_timeout (void *);
 static void return_from_alarm (void *);
 
 static void thread_trampoline (void *vpth);
+static pseudothread new_worker (int stack_size);
+static void free_idle_worker (void);
 
 static void pseudothread_init (void) __attribute__ ((constructor));
 
@@ -139,13 +188,22 @@ pseudothread_init ()
   /* OpenBSD doesn't call constructors in the correct order. */
   pool global_pool = new_pool ();
 #endif
-  threads = new_vector (global_pool, struct pseudothread *);
+  free_slots = new_vector (global_pool, int);
 }
 
 int
 pseudothread_set_stack_size (int size)
 {
-  return default_stack_size = size;
+  if (size != default_stack_size)
+    {
+      default_stack_size = size;
+
+      /* Idle workers with the old stack size would never be reused. */
+      while (nr_idle > 0)
+	free_idle_worker ();
+      refill_idle_workers (0);
+    }
+  return size;
 }
 
 int
@@ -158,49 +216,166 @@ pseudothread
 new_pseudothread (pool pool,
 		  void (*run) (void *), void *data,
 		  const char *name)
+{
+  return new_pseudothread_with_stack (pool, run, data, name, 0);
+}
+
+pseudothread
+new_pseudothread_with_stack (pool pool,
+			     void (*run) (void *), void *data,
+			     const char *name, int stack_size)
 {
   pseudothread pth;
   void *stack_addr;
-  int i;
 
-  /* Allocate space for the pseudothread. */
-  pth = pcalloc (pool, 1, sizeof *pth);
+  if (stack_size <= 0) stack_size = default_stack_size;
+
+  if (idle_workers && idle_workers->stack_size == stack_size)
+    {
+      /* Reuse an idle worker. Its stack and context are already set up. */
+      pth = idle_workers;
+      idle_workers = pth->next_idle;
+      nr_idle--;
+      if (nr_idle < min_idle)
+	reactor_schedule (&refill);
+    }
+  else if (max_idle > 0 && stack_size == default_stack_size)
+    {
+      pth = new_worker (stack_size);
+      if (nr_idle < min_idle)
+	reactor_schedule (&refill);
+    }
+  else
+    {
+      /* Allocate space for the pseudothread. */
+      pth = pcalloc (pool, 1, sizeof *pth);
+
+      /* Create a stack for this thread. */
+      stack_addr = _pth_get_stack (stack_size);
+      if (stack_addr == 0) abort ();
+      pth->stack = stack_addr;
+      pth->stack_size = stack_size;
+      pth->stack_hwm = -1;
+
+      /* Create a new thread context. */
+      mctx_set (&pth->thread_ctx,
+		thread_trampoline, pth,
+		stack_addr, stack_size);
+    }
 
   pth->run = run;
   pth->data = data;
   pth->pool = pool;
   pth->name = name;
 
-  /* Create a stack for this thread. */
-  stack_addr = _pth_get_stack (default_stack_size);
-  if (stack_addr == 0) abort ();
-  pth->stack = stack_addr;
-  pth->stack_size = default_stack_size;
+  /* Give the thread a number, and add it to the list of threads. */
+  if (vector_size (free_slots) > 0)
+    vector_pop_back (free_slots, pth->n);
+  else
+    pth->n = next_slot++;
+
+  pth->next_live = 0;
+  pth->prev_live = live_tail;
+  if (live_tail) live_tail->next_live = pth;
+  else live_head = pth;
+  live_tail = pth;
+  nr_threads++;
+
+  if (spawn_hook)
+    spawn_hook (pth, spawn_hook_data);
+
+  return pth;
+}
+
+static pseudothread
+new_worker (int stack_size)
+{
+  pseudothread pth;
+
+  pth = malloc (sizeof *pth);
+  if (pth == 0) abort ();
+  memset (pth, 0, sizeof *pth);
+  pth->worker = 1;
+
+  pth->stack = _pth_get_stack (stack_size);
+  if (pth->stack == 0) abort ();
+  pth->stack_size = stack_size;
+  pth->stack_hwm = -1;
 
-  /* Create a new thread context. */
   mctx_set (&pth->thread_ctx,
 	    thread_trampoline, pth,
-	    stack_addr, default_stack_size);
+	    pth->stack, stack_size);
 
-  /* Allocate space in the global threads list for this thread. */
-  for (i = 0; i < vector_size (threads); ++i)
-    {
-      pseudothread p;
+  return pth;
+}
 
-      vector_get (threads, i, p);
-      if (p == 0)
-	{
-	  pth->n = i;
-	  vector_replace (threads, i, pth);
-	  goto done;
-	}
+/* Throw away the first idle worker. Its stack isn't in use. */
+static void
+free_idle_worker (void)
+{
+  pseudothread pth = idle_workers;
+
+  idle_workers = pth->next_idle;
+  nr_idle--;
+  _pth_return_stack (pth->stack, pth->stack_size);
+  free (pth);
+}
+
+/* Create workers in advance, up to min_idle. These start at the
+ * beginning of thread_trampoline when they are first used.
+ */
+static void
+refill_idle_workers (void *data)
+{
+  pseudothread pth;
+
+  while (nr_idle < min_idle)
+    {
+      pth = new_worker (default_stack_size);
+      pth->next_idle = idle_workers;
+      idle_workers = pth;
+      nr_idle++;
     }
+}
 
-  pth->n = i;
-  vector_push_back (threads, pth);
+void
+pseudothread_set_idle_workers (int _min_idle, int _max_idle)
+{
+  if (_max_idle < 0) _max_idle = 0;
+  if (_min_idle > _max_idle) _min_idle = _max_idle;
+  if (_min_idle < 0) _min_idle = 0;
 
- done:
-  return pth;
+  min_idle = _min_idle;
+  max_idle = _max_idle;
+
+  while (nr_idle > max_idle)
+    free_idle_worker ();
+  refill_idle_workers (0);
+}
+
+int
+pseudothread_count_idle_workers (void)
+{
+  return nr_idle;
+}
+
+void
+_pth_set_spawn_hook (void (*fn) (pseudothread, void *), void *data)
+{
+  spawn_hook = fn;
+  spawn_hook_data = data;
+}
+
+static inline void
+remove_thread (pseudothread pth)
+{
+  if (pth->prev_live) pth->prev_live->next_live = pth->next_live;
+  else live_head = pth->next_live;
+  if (pth->next_live) pth->next_live->prev_live = pth->prev_live;
+  else live_tail = pth->prev_live;
+  nr_threads--;
+
+  vector_push_back (free_slots, pth->n);
 }
 
 static void
@@ -210,27 +385,55 @@ thread_trampoline (void *vpth)
   mctx_t calling_ctx;
   void *stack;
   int stack_size;
-  const struct pseudothread *null_thread = 0;
-
-  /* Set up the current_pth before running user code. */
-  current_pth = pth;
-
-  if (setjmp (pth->exit_jmp) == 0)
-    pth->run (pth->data);
 
-  /* We return here either when "run" finishes normally or after
-   * a longjmp caused by the pseudothread calling pth_exit.
-   */
+  for (;;)
+    {
+      /* Set up the current_pth before running user code. */
+      current_pth = pth;
+
+      if (setjmp (pth->exit_jmp) == 0)
+	pth->run (pth->data);
+
+      /* We return here either when "run" finishes normally or after
+       * a longjmp caused by the pseudothread calling pth_exit.
+       */
+
+      /* Remove the thread from the list of threads. */
+      remove_thread (pth);
+
+      if (!pth->worker || nr_idle >= max_idle ||
+	  pth->stack_size != default_stack_size)
+	break;
+
+      /* Keep the thread as an idle worker. Everything which belonged to
+       * the old thread was allocated in its pool, so just forget it.
+       */
+      delete_pool (pth->pool);
+      pth->pool = 0;
+      pth->alarm_received = 0;
+      pth->alarm_timer = 0;
+      pth->exception_jmp_vec = 0;
+      pth->exception_msg = 0;
+      pth->poll_timeout = 0;
+      pth->lang = pth->tz = 0;
+
+      pth->next_idle = idle_workers;
+      idle_workers = pth;
+      nr_idle++;
+
+      /* Go back to the calling context. When new_pseudothread reuses
+       * this worker, pth_start switches back in here.
+       */
+      mctx_switch (&pth->thread_ctx, &pth->calling_ctx);
+    }
 
   calling_ctx = pth->calling_ctx;
 
-  /* Remove the thread from the list of threads. */
-  vector_replace (threads, pth->n, null_thread);
-
   /* Delete the pool and the stack. */
   stack = pth->stack;
   stack_size = pth->stack_size;
   delete_pool (pth->pool);
+  if (pth->worker) free (pth);
   _pth_return_stack (stack, stack_size);
 
   /* Restore calling context (this never returns ...). */
@@ -303,6 +506,14 @@ pth_get_stack_size (pseudothread pth)
   return pth->stack_size;
 }
 
+int
+pth_get_stack_hwm (pseudothread pth)
+{
+  if (pth->stack_hwm >= 0)
+    return pth->stack_hwm;
+  return _pth_stack_hwm (pth->stack, pth->stack_size);
+}
+
 unsigned long
 pth_get_PC (pseudothread pth)
 {
@@ -457,6 +668,43 @@ pth_write (int s, const void *buf, size_t count)
   return r;
 }
 
+ssize_t
+pth_writev (int s, const struct iovec *iov, int iovcnt)
+{
+  int r;
+
+ again:
+  r = writev (s, iov, iovcnt);
+  if (r == -1 && errno == EWOULDBLOCK)
+    {
+      block (s, REACTOR_WRITE);
+      goto again;
+    }
+
+  return r;
+}
+
+ssize_t
+pth_sendfile (int out_fd, int in_fd, off_t *offset, size_t count)
+{
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+  ssize_t r;
+
+ again:
+  r = sendfile (out_fd, in_fd, offset, count);
+  if (r == -1 && errno == EWOULDBLOCK)
+    {
+      block (out_fd, REACTOR_WRITE);
+      goto again;
+    }
+
+  return r;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
 int
 pth_sleep (int seconds)
 {
@@ -705,7 +953,7 @@ pth_wait_readable (int fd)
   fds[0].revents = 0;		/* Don't care. */
 
  again:
-  r = poll (fds, 1, -1);
+  r = poll (fds, 1, 0);
   if (r == 0)
     {
       block (fd, REACTOR_READ);
@@ -726,7 +974,7 @@ pth_wait_writable (int fd)
   fds[0].revents = 0;		/* Don't care. */
 
  again:
-  r = poll (fds, 1, -1);
+  r = poll (fds, 1, 0);
   if (r == 0)
     {
       block (fd, REACTOR_WRITE);
@@ -781,9 +1029,43 @@ do_setenv (const char *name, const char *value)
 #error "no setenv/unsetenv or putenv in your libc"
 #endif
 
+/* The values of LANGUAGE and TZ which are currently installed in the
+ * environment. Switching between threads only touches the environment
+ * (and, for LANGUAGE, invalidates the gettext caches) when the thread
+ * being resumed wants a different value from the one installed.
+ */
+struct installed_value
+{
+  int known;			/* Do we know what is installed? */
+  int set;			/* Is the variable set? */
+  char value[256];		/* If so, its value. */
+};
+
+static struct installed_value installed_lang, installed_tz;
+
+/* Returns true if the value is already installed, else records it as
+ * being installed and returns false.
+ */
+static inline int
+_check_installed (struct installed_value *iv, const char *value)
+{
+  if (iv->known &&
+      (value ? iv->set && strcmp (iv->value, value) == 0 : !iv->set))
+    return 1;
+
+  /* Values too long for the buffer are simply installed every time. */
+  iv->known = !value || strlen (value) < sizeof iv->value;
+  iv->set = value != 0;
+  if (iv->known && value) strcpy (iv->value, value);
+  return 0;
+}
+
 static inline void
 _restore_lang ()
 {
+  if (_check_installed (&installed_lang, current_pth->lang))
+    return;
+
   if (current_pth->lang == 0)
     do_unsetenv ("LANGUAGE");
   else
@@ -803,6 +1085,9 @@ _restore_lang ()
 static inline void
 _restore_tz ()
 {
+  if (_check_installed (&installed_tz, current_pth->tz))
+    return;
+
   if (current_pth->tz == 0)
     do_unsetenv ("TZ");
   else
@@ -978,28 +1263,24 @@ vector
 pseudothread_get_threads (pool pool)
 {
   vector v = new_vector (pool, struct pseudothread);
-  int i;
+  pseudothread pth;
 
-  for (i = 0; i < vector_size (threads); ++i)
+  for (pth = live_head; pth; pth = pth->next_live)
     {
-      pseudothread pth;
       struct pseudothread pth_copy;
 
-      vector_get (threads, i, pth);
-
-      if (pth)
-	{
-	  /* Perform a deep copy of the structure. */
-	  memcpy (&pth_copy, pth, sizeof pth_copy);
-	  if (pth_copy.name)
-	    pth_copy.name = pstrdup (pool, pth_copy.name);
-	  if (pth_copy.lang)
-	    pth_copy.lang = pstrdup (pool, pth_copy.lang);
-	  if (pth_copy.tz)
-	    pth_copy.tz = pstrdup (pool, pth_copy.tz);
-
-	  vector_push_back (v, pth_copy);
-	}
+      /* Perform a deep copy of the structure. */
+      memcpy (&pth_copy, pth, sizeof pth_copy);
+      if (pth_copy.name)
+	pth_copy.name = pstrdup (pool, pth_copy.name);
+      if (pth_copy.lang)
+	pth_copy.lang = pstrdup (pool, pth_copy.lang);
+      if (pth_copy.tz)
+	pth_copy.tz = pstrdup (pool, pth_copy.tz);
+      pth_copy.stack_hwm = pth_get_stack_hwm (pth);
+      pth_copy.prev_live = pth_copy.next_live = 0;
+
+      vector_push_back (v, pth_copy);
     }
 
   return v;
@@ -1008,17 +1289,5 @@ pseudothread_get_threads (pool pool)
 int
 pseudothread_count_threads (void)
 {
-  int count = 0;
-  int i;
-
-  for (i = 0; i < vector_size (threads); ++i)
-    {
-      pseudothread pth;
-
-      vector_get (threads, i, pth);
-
-      if (pth) count++;
-    }
-
-  return count;
+  return nr_threads;
 }
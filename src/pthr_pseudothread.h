@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <setjmp.h>
 #include <time.h>
 
@@ -33,6 +34,7 @@
 
 #include "pthr_reactor.h"
 #include "pthr_context.h"
+#include "pthr_stack.h"
 
 struct pseudothread;
 typedef struct pseudothread *pseudothread;
@@ -54,12 +56,42 @@ extern pseudothread current_pth;
  * @code{pseudothread_get_stack_size} returns the current
  * stack size setting.
  *
- * See also: @ref{new_pseudothread(3)}.
+ * See also: @ref{new_pseudothread(3)},
+ * @ref{pseudothread_set_stack_cache(3)}.
  */
 extern int pseudothread_set_stack_size (int size);
 extern int pseudothread_get_stack_size (void);
 
+/* Function: pseudothread_set_idle_workers - keep finished threads for reuse
+ * Function: pseudothread_count_idle_workers
+ *
+ * Creating a thread means allocating its structure and stack and
+ * setting up a new context, and all of this is undone when the thread
+ * exits. A server which creates a thread per connection does this
+ * thousands of times a second.
+ *
+ * @code{pseudothread_set_idle_workers} keeps up to @code{max_idle}
+ * threads which have finished, with their stack and context intact.
+ * @ref{new_pseudothread(3)} hands the next @code{run} function to one
+ * of these idle workers, so starting it costs just a context switch.
+ * The thread's pool is still deleted when it exits, as usual.
+ * @code{min_idle} idle workers are created straight away, and
+ * whenever new threads take the number below @code{min_idle}, it is
+ * topped up again the next time the reactor runs. The default is 0
+ * and 0, which turns this off. Only threads with the default stack
+ * size are reused, so changing the default stack size (see
+ * @ref{pseudothread_set_stack_size(3)}) replaces the idle workers.
+ *
+ * @code{pseudothread_count_idle_workers} returns the number of idle
+ * workers.
+ *
+ * See also: @ref{pseudothread_set_stack_cache(3)}.
+ */
+extern void pseudothread_set_idle_workers (int min_idle, int max_idle);
+extern int pseudothread_count_idle_workers (void);
+
 /* Function: new_pseudothread - lightweight "pseudothreads" library
+ * Function: new_pseudothread_with_stack
  * Function: pth_start
  * Function: pseudothread_get_threads
  * Function: pseudothread_count_threads
@@ -76,6 +108,14 @@ extern int pseudothread_get_stack_size (void);
  * arguments are the entry point into the thread. The entry
  * point is called as @code{run (data)}.
  *
+ * @code{new_pseudothread_with_stack} is the same, but gives the
+ * thread a stack of @code{stack_size} bytes instead of the
+ * default (see @ref{pseudothread_set_stack_size(3)}). Stack memory
+ * is only reserved, and pages are allocated as the thread uses them,
+ * so it is reasonable to give a thread which recurses deeply a
+ * stack of several megabytes. Use @ref{pth_get_stack_hwm(3)} to find
+ * out how much of its stack a thread really uses.
+ *
  * @code{pseudothread_get_threads} returns a list of all the
  * currently running pseudothreads. This allows you to implement
  * a "process listing" for a program. The returned value
@@ -87,6 +127,7 @@ extern int pseudothread_get_stack_size (void);
  * running threads.
  */
 extern pseudothread new_pseudothread (pool, void (*run) (void *), void *data, const char *name);
+extern pseudothread new_pseudothread_with_stack (pool, void (*run) (void *), void *data, const char *name, int stack_size);
 extern void pth_start (pseudothread pth);
 extern vector pseudothread_get_threads (pool);
 extern int pseudothread_count_threads (void);
@@ -95,13 +136,15 @@ extern int pseudothread_count_threads (void);
  * Function: pth_connect
  * Function: pth_read
  * Function: pth_write
+ * Function: pth_writev
+ * Function: pth_sendfile
  * Function: pth_sleep
  * Function: pth_millisleep
  * Function: pth_nanosleep
  * Function: pth_timeout
  *
  * @code{pth_accept}, @code{pth_connect}, @code{pth_read}, @code{pth_write},
- * @code{pth_sleep} and @code{pth_nanosleep} behave just like the
+ * @code{pth_writev}, @code{pth_sleep} and @code{pth_nanosleep} behave just like the
  * corresponding system calls. However these calls handle non-blocking
  * sockets and cause the thread to sleep on the reactor if it would
  * block. For general I/O you will probably wish to wrap up your
@@ -110,6 +153,13 @@ extern int pseudothread_count_threads (void);
  *
  * @code{pth_millisleep} sleeps for a given number of milliseconds.
  *
+ * @code{pth_sendfile} is the Linux @ref{sendfile(2)} system call,
+ * which copies @code{count} bytes from file @code{in_fd} to socket
+ * @code{out_fd} inside the kernel. Where there is no such system
+ * call it returns -1 with @code{errno} set to @code{ENOSYS}. Use
+ * @ref{io_sendfile(3)} instead, which falls back to copying the
+ * data.
+ *
  * @code{pth_timeout} is similar to the @ref{alarm(2)} system call: it
  * registers a timeout (in seconds). The thread will exit automatically
  * (even in the middle of a system call) if the timeout is reached.
@@ -121,6 +171,8 @@ extern int pth_accept (int, struct sockaddr *, int *);
 extern int pth_connect (int, struct sockaddr *, int);
 extern ssize_t pth_read (int, void *, size_t);
 extern ssize_t pth_write (int, const void *, size_t);
+extern ssize_t pth_writev (int, const struct iovec *, int);
+extern ssize_t pth_sendfile (int out_fd, int in_fd, off_t *offset, size_t count);
 extern int pth_sleep (int seconds);
 extern int pth_millisleep (int millis);
 extern int pth_nanosleep (const struct timespec *req, struct timespec *rem);
@@ -234,6 +286,7 @@ extern void _pth_die (const char *msg,
  * Function: pth_get_tz
  * Function: pth_get_stack
  * Function: pth_get_stack_size
+ * Function: pth_get_stack_hwm
  * Function: pth_get_PC
  * Function: pth_get_SP
  * Function: pth_set_name
@@ -271,6 +324,17 @@ extern void _pth_die (const char *msg,
  * @code{pth_get_stack_size} returns the maximum size of the stack for
  * this thread.
  *
+ * @code{pth_get_stack_hwm} returns the stack high water mark, that
+ * is, how many bytes of its stack the thread has used so far, to
+ * the nearest page. It counts the pages which are resident, so a
+ * stack reused from the stack cache (see
+ * @ref{pseudothread_set_stack_cache(3)}) also includes pages used by
+ * earlier threads, unless @code{release_pages} is set and the kernel
+ * has reclaimed them. For the copies returned by
+ * @ref{pseudothread_get_threads(3)}, this is the value at the time
+ * of the call. It returns -1 if the high water mark cannot be found
+ * on this platform.
+ *
  * @code{pth_get_PC} returns the current program counter (PC) for
  * this thread. Obviously it only makes sense to call this from
  * another thread.
@@ -303,6 +367,7 @@ extern const char *pth_get_language (pseudothread pth);
 extern const char *pth_get_tz (pseudothread pth);
 extern void *pth_get_stack (pseudothread pth);
 extern int pth_get_stack_size (pseudothread pth);
+extern int pth_get_stack_hwm (pseudothread pth);
 extern unsigned long pth_get_PC (pseudothread pth);
 extern unsigned long pth_get_SP (pseudothread pth);
 extern void pth_set_name (const char *name);
@@ -311,10 +376,13 @@ extern void pth_set_tz (const char *tz);
 
 /* These low-level functions are used by other parts of the pthrlib library.
  * Do not use them from user programs. They switch thread context with the
- * calling context and v.v.
+ * calling context and v.v. _pth_set_spawn_hook arranges for a function
+ * to be called with each new thread as it is created (the listener uses
+ * this to count connections).
  */
 extern void _pth_switch_thread_to_calling_context (void);
 extern void _pth_switch_calling_to_thread_context (pseudothread new_pth);
 extern int  _pth_alarm_received (void);
+extern void _pth_set_spawn_hook (void (*fn) (pseudothread, void *), void *data);
 
 #endif /* PTHR_PSEUDOTHREAD_H */
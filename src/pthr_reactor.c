@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #ifdef HAVE_SYS_POLL_H
 #include <sys/poll.h>
@@ -47,22 +48,75 @@
 #include <string.h>
 #endif
 
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include "pthr_reactor.h"
 
 #define REACTOR_DEBUG 0
 
+/* Use epoll(7) if the system has it. It can still be disabled at run
+ * time by setting PTHRLIB_REACTOR=poll in the environment.
+ */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE)
+#define REACTOR_EPOLL 1
+#else
+#define REACTOR_EPOLL 0
+#endif
+
+/* Maximum number of events collected by a single call to epoll_wait. */
+#define REACTOR_MAX_EVENTS 256
+
+/* Events which are always watched for on attached descriptors. */
+#define REACTOR_ATTACHED_EVENTS (POLLIN | POLLOUT | POLLPRI)
+
 struct reactor_handle
 {
-  int offset;			/* Points into internal poll fds array. */
+  int fd;			/* File descriptor, or -1 if handle unused. */
+  int operations;		/* Events this handle is interested in. */
+  int prev, next;		/* Other handles on the same fd (or free list). */
+  unsigned serial;		/* Changes each time the handle is reused. */
   void (*fn) (int, int, void *);
   void *data;
 };
 
+struct reactor_fd
+{
+  int head;			/* First handle on this fd, or -1 if none. */
+  int events;			/* Union of the operations of those handles. */
+  int offset;			/* Offset in POLL_ARRAY, or -1 if not there. */
+  int in_epoll;			/* True if fd is in the epoll set. */
+  int attached;			/* Number of times reactor_attach_fd called. */
+  int ready;			/* Attached fds: events seen but not consumed. */
+};
+
+struct reactor_ready
+{
+  int handle;
+  unsigned serial;
+  int fd;
+  int revents;
+};
+
 struct reactor_timer
 {
   pool pool;
-  struct reactor_timer *prev, *next;
-  unsigned long long delta;
+  struct reactor_timer *prev, *next; /* Circular list of timers in slot. */
+  reactor_time_t expires;	/* Time at which this timer fires. */
+  int slot;			/* Slot in WHEEL which contains this timer. */
   void (*fn) (void *);
   void *data;
 };
@@ -76,73 +130,156 @@ struct reactor_prepoll
   int fired;
 };
 
-/* This is how HANDLES and POLL_ARRAY work:
+/* This is how HANDLES, FDS and POLL_ARRAY work:
  *
  * HANDLES is a straightforward list of reactor handle objects. When
  * a user registers an event handler in the reactor, they get back
  * an integer which is in fact an offset into the HANDLES array.
+ * Unused handles are chained together through their NEXT field
+ * starting at FREE_HANDLE, so finding a free handle is O(1). We
+ * never decrease the size of the HANDLES array.
  *
- * POLL_ARRAY is the array which actually gets passed to the poll(2)
- * system call.
+ * FDS is indexed by file descriptor. All the handles registered on
+ * one file descriptor are kept on a doubly linked list (through the
+ * PREV and NEXT fields of the handles) starting at FDS[fd].HEAD, and
+ * FDS[fd].EVENTS is the union of the events they want. It is this
+ * union which is passed to the kernel, so several handles which
+ * share a file descriptor cost only one entry there.
  *
- * HANDLES and POLL_ARRAY are related through the OFFSET field in
- * a reactor handle. Thus:
+ * With the poll backend, POLL_ARRAY contains one pollfd for each
+ * file descriptor which has handles, and FDS[fd].OFFSET points back
+ * into it:
  *
  * HANDLES:     +------+------+------+------+------+
- *      offset: | 2    | 1    | 3    | 3    | 0    |
- *              |      |      |      |      |      |
- *              | |    | |    |  \   | |    | |    |
- *              | |    | |    |   \  | |    | |    |
- *              +-|----+-|----+----\-+-|----+-|----+
- *                 \_____|_____     \  |      |
- * POLL_ARRAY:  +------+-|----+\-----\-|----+ |
- *              |      | |    | \    |\     | |
- *              |      |      |      |      | |
- *              |     _______________________/
- *              |      |      |      |      |
- *              +------+------+------+------+
+ *          fd: | 5    | 7    | free | 5    | 9    |
+ *              +-|----+-|----+------+-|----+-|----+
+ *                |      |             |      |
+ * FDS:        [5] head=0 -> 3 (events = union of handles 0 and 3)
+ *             [7] head=1      [9] head=4
+ *                |      |             |
+ * POLL_ARRAY:  +------+------+------+
+ *              | fd 5 | fd 9 | fd 7 |
+ *              +------+------+------+
  *
- * Note that you may have two handles pointing to the same offset
- * in POLL_ARRAY: this happens when we share pollfds because they
- * both contain the same fd and event information.
+ * Removing a file descriptor from POLL_ARRAY moves the last element
+ * into the hole (and fixes the OFFSET of that element's fd), so
+ * registering and unregistering handles are both O(1) (strictly,
+ * O(number of handles on that fd), which is nearly always 1 or 2).
  *
- * If the OFFSET field of a handle contains -1, then the handle
- * is unused. Notice that we never decrease the size of the HANDLES
- * array.
+ * With the epoll backend, the union of events is passed to epoll_ctl
+ * instead and POLL_ARRAY is only used for the occasional descriptor
+ * which epoll refuses (regular files, for instance), which poll
+ * reports as always ready.
  *
- * Adding (registering) a handle is easy enough: firstly we look for
- * an unused (offset == -1) handle, and if not found we reallocate
- * the HANDLES array to make it larger. Then we search through the
- * POLL_ARRAY to see if it's possible to share. If not, we extend
- * the POLL_ARRAY by 1 and set the offset accordingly.
+ * A descriptor may also be attached (see reactor_attach_fd) for as
+ * long as it stays open. With epoll, an attached descriptor is added
+ * to the epoll set once, edge-triggered, for all events, and the
+ * edges which the kernel reports are accumulated in FDS[fd].READY.
+ * Registering a handle on it then costs no system call: if the events
+ * the handle wants have already been seen, the handle is put on the
+ * PENDING list to be called on the next reactor_invoke, otherwise it
+ * just waits for the next edge. Events are consumed (cleared from
+ * FDS[fd].READY) when they are passed to a handler, apart from POLLERR
+ * and POLLHUP which are permanent. This is safe because callers only
+ * block on a descriptor after the operation has returned EAGAIN: at
+ * worst a stale event causes one unnecessary retry.
  *
- * Deleting (unregistering) a handle is not so easy: deleting the
- * handle is OK -- just set the offset to -1. But we must also
- * check the POLL_ARRAY entry, and if it is not shared, delete it,
- * shrink the POLL_ARRAY and update all handles which point to
- * an offset larger than the deleted element in POLL_ARRAY.
+ * Dispatching is done in two steps: first we collect the handles to
+ * call into READY (noting each handle's SERIAL), then we call them.
+ * Calling a handler may register or unregister any handle, so before
+ * each call we check that the handle is still the one we collected.
+ * With epoll, the cost of this is proportional to the number of
+ * ready descriptors, not to the number of registered descriptors.
  */
 
-
 /* The list of reactor handles registered. */
 static struct reactor_handle *handles = 0;
-static struct pollfd *poll_array = 0;
 static int nr_handles_allocated = 0;
+static int free_handle = -1;
+
+/* Per-file descriptor information. */
+static struct reactor_fd *fds = 0;
+static int nr_fds_allocated = 0;
+
+/* The array passed to poll(2). */
+static struct pollfd *poll_array = 0;
 static int nr_array_allocated = 0;
 static int nr_array_used = 0;
 
-/* The list of timers, stored in time order (in a delta queue). */
-static struct reactor_timer *head_timer = 0;
+/* Handles which are ready, collected before dispatching. */
+static struct reactor_ready *ready = 0;
+
+/* Handles registered on attached fds whose events had already been seen. */
+static struct reactor_ready *pending = 0;
+static int nr_pending_allocated = 0;
+static int nr_pending = 0;
+
+/* The epoll file descriptor, or -1 if using the poll backend. This is
+ * created lazily so that a process which forks before using the
+ * reactor does not share it between parent and child.
+ */
+static int epoll_fd = -1;
+static int backend_initialised = 0;
+
+/* Timers are stored in a hierarchical timing wheel (the scheme used
+ * by the Linux kernel). Level 0 has 256 slots of 1 ms each. Levels 1
+ * to 4 each have 64 slots, and each slot covers the whole span of the
+ * level below, ie. 256 ms, 16 s, 17 mins and 18 hours respectively.
+ * Each slot is a circular doubly linked list of timers. A timer is
+ * put into the lowest level whose span reaches its expiry time, so
+ * setting and removing a timer are both O(1).
+ *
+ * WHEEL_TIME is the next tick (millisecond) which has not yet been
+ * processed. Level 0 slot (WHEEL_TIME & 255) contains the timers
+ * which expire at that tick. Whenever WHEEL_TIME crosses a multiple
+ * of 256 ms, the next slot of level 1 is "cascaded": its timers are
+ * reinserted, so they move down into level 0, and likewise for the
+ * higher levels. Each timer is therefore moved at most four times
+ * during its life.
+ *
+ * WHEEL_BITS records which slots are non-empty, so that we can skip
+ * straight to the next tick with something to do, and work out how
+ * long poll should wait, without looking at every slot.
+ *
+ * Timers which are set to expire before WHEEL_TIME (eg. with a timeout
+ * of 0) go on a separate list which is run on the next reactor_invoke.
+ */
+#define WHEEL_L0_BITS 8
+#define WHEEL_LN_BITS 6
+#define WHEEL_LEVELS 5
+#define WHEEL_SIZE ((1 << WHEEL_L0_BITS) + \
+		    (WHEEL_LEVELS-1) * (1 << WHEEL_LN_BITS))
+#define WHEEL_EXPIRED WHEEL_SIZE
+#define WHEEL_SHIFT(l) ((l) == 0 ? 0 : \
+			WHEEL_L0_BITS + ((l)-1) * WHEEL_LN_BITS)
+#define WHEEL_BASE(l) ((l) == 0 ? 0 : \
+		       (1 << WHEEL_L0_BITS) + ((l)-1) * (1 << WHEEL_LN_BITS))
+
+static struct reactor_timer *wheel[WHEEL_SIZE + 1];
+static unsigned long long wheel_bits[WHEEL_SIZE / 64];
+static reactor_time_t wheel_time;
+static int nr_timers = 0;
 
 /* The list of prepoll handlers in no particular order. */
 static struct reactor_prepoll *head_prepoll = 0;
 
+/* The run queue, a circular list with RUN_QUEUE itself as the head. */
+static struct reactor_runnable run_queue = { &run_queue, &run_queue, 0, 0 };
+
 /* The current time, or near as dammit, in milliseconds from Unix epoch. */
 unsigned long long reactor_time;
 
 /* Function prototypes. */
 static void remove_timer (void *timerp);
+static void add_timer (reactor_timer timer);
+static void run_timers (void);
+static reactor_time_t next_timer_tick (reactor_time_t t, reactor_time_t limit);
 static void remove_prepoll (void *timerp);
+static void init_backend (void);
+static void update_fd (int fd);
+static void grow_fds (int fd);
+static void check_pending (int h);
+static void detach_fd (void *fdp);
 
 /* Cause reactor_init / reactor_stop to be called automatically. */
 static void reactor_init (void) __attribute__ ((constructor));
@@ -163,13 +300,13 @@ reactor_init ()
   /* Update the reactor time. */
   gettimeofday (&tv, 0);
   reactor_time = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+  wheel_time = reactor_time;
 }
 
 static void
 reactor_stop ()
 {
   int i;
-  reactor_timer p, p_next;
   reactor_prepoll prepoll, prepoll_next;
 
   /* There should be no prepoll handlers registered. Check it and free them.*/
@@ -182,79 +319,121 @@ reactor_stop ()
     }
 
   /* There should be no timers registered. Check it and free them up. */
-  for (p = head_timer; p; p = p_next)
-    {
-      syslog (LOG_WARNING, "timer left registered in reactor: fn=%p, data=%p",
-	      p->fn, p->data);
-      p_next = p->next;
-      delete_pool (p->pool);
-    }
+  for (i = 0; i <= WHEEL_SIZE; ++i)
+    while (wheel[i])
+      {
+	syslog (LOG_WARNING, "timer left registered in reactor: fn=%p, data=%p",
+		wheel[i]->fn, wheel[i]->data);
+	delete_pool (wheel[i]->pool);
+      }
 
   /* There should be no handles registered. Check for this. */
   for (i = 0; i < nr_handles_allocated; ++i)
-    if (handles[i].offset >= 0)
+    if (handles[i].fd >= 0)
       syslog (LOG_WARNING, "handle left registered in reactor: fn=%p, data=%p",
 	      handles[i].fn, handles[i].data);
 
+#if REACTOR_EPOLL
+  if (epoll_fd >= 0) close (epoll_fd);
+#endif
+
   /* Free up memory used by handles. */
   if (handles) free (handles);
+  if (fds) free (fds);
   if (poll_array) free (poll_array);
+  if (ready) free (ready);
+  if (pending) free (pending);
+}
+
+static void
+init_backend ()
+{
+  backend_initialised = 1;
+
+#if REACTOR_EPOLL
+#ifdef HAVE_GETENV
+  {
+    const char *env = getenv ("PTHRLIB_REACTOR");
+
+    if (env && strcmp (env, "poll") == 0)
+      return;
+  }
+#endif
+
+  /* If epoll_create fails (eg. ENOSYS on an old kernel) then just
+   * fall back to using poll.
+   */
+  epoll_fd = epoll_create (REACTOR_MAX_EVENTS);
+  if (epoll_fd >= 0)
+    fcntl (epoll_fd, F_SETFD, FD_CLOEXEC);
+#endif
 }
 
 reactor_handle
 reactor_register (int socket, int operations,
 		  void (*fn) (int socket, int events, void *), void *data)
 {
-  int i, h, a;
+  int i, h;
+  struct reactor_fd *f;
 
-  /* Find an unused handle. */
-  for (i = 0; i < nr_handles_allocated; ++i)
-    if (handles[i].offset == -1)
-      {
-	h = i;
-	goto found_handle;
-      }
+  if (!backend_initialised) init_backend ();
 
-  /* No free handles: allocate a new handle. */
-  h = nr_handles_allocated;
-  nr_handles_allocated += 8;
-  handles = realloc (handles,
-		     nr_handles_allocated * sizeof (struct reactor_handle));
-  for (i = h; i < nr_handles_allocated; ++i)
-    handles[i].offset = -1;
-
- found_handle:
-  /* Examine the poll descriptors to see if we can share with an
-   * existing descriptor.
-   */
-  for (a = 0; a < nr_array_used; ++a)
-    if (poll_array[a].fd == socket &&
-	poll_array[a].events == operations)
-      goto found_poll_descriptor;
-
-  /* Allocate space in the array of poll descriptors. */
-  if (nr_array_used >= nr_array_allocated)
+  /* No free handles: allocate some new handles. */
+  if (free_handle == -1)
     {
-      nr_array_allocated += 8;
-      poll_array = realloc (poll_array,
-			    nr_array_allocated * sizeof (struct pollfd));
+      h = nr_handles_allocated;
+      nr_handles_allocated = h ? h * 2 : 8;
+      handles = realloc (handles,
+			 nr_handles_allocated * sizeof (struct reactor_handle));
+      /* A handle can be collected at most twice in one reactor_invoke:
+       * once from PENDING and once from the kernel.
+       */
+      ready = realloc (ready,
+		       2 * nr_handles_allocated * sizeof (struct reactor_ready));
+      for (i = nr_handles_allocated - 1; i >= h; --i)
+	{
+	  handles[i].fd = -1;
+	  handles[i].serial = 0;
+	  handles[i].next = free_handle;
+	  free_handle = i;
+	}
     }
-  a = nr_array_used++;
 
-  /* Create the poll descriptor. */
-  poll_array[a].fd = socket;
-  poll_array[a].events = operations;
+  /* Make sure there is an entry for this file descriptor. */
+  if (socket >= nr_fds_allocated) grow_fds (socket);
+
+  /* Take a handle off the free list. */
+  h = free_handle;
+  free_handle = handles[h].next;
 
- found_poll_descriptor:
-  /* Create the handle. */
-  handles[h].offset = a;
+  /* Create the handle and link it into the list for this fd. */
+  f = &fds[socket];
+  handles[h].fd = socket;
+  handles[h].operations = operations;
+  handles[h].serial++;
   handles[h].fn = fn;
   handles[h].data = data;
+  handles[h].prev = -1;
+  handles[h].next = f->head;
+  if (f->head >= 0) handles[f->head].prev = h;
+  f->head = h;
+
+  /* If the fd is attached the kernel already knows, but we may have
+   * seen the event already.
+   */
+  if (f->attached)
+    check_pending (h);
+  /* Tell the kernel if the set of events has changed. */
+  else if ((f->events & operations) != operations)
+    {
+      f->events |= operations;
+      update_fd (socket);
+    }
 
 #if REACTOR_DEBUG
   fprintf (stderr,
-	   "reactor_register (fd=%d, ops=0x%x, fn=%p, data=%p) = %p\n",
-	   socket, operations, fn, data, &handles[h]);
+	   "reactor_register (fd=%d, ops=0x%x, fn=%p, data=%p) = %d\n",
+	   socket, operations, fn, data, h);
 #endif
 
   /* Return the handle. */
@@ -264,31 +443,254 @@ reactor_register (int socket, int operations,
 void
 reactor_unregister (reactor_handle handle)
 {
-  int i, a = handles[handle].offset;
+  struct reactor_handle *hp = &handles[handle];
+  struct reactor_fd *f = &fds[hp->fd];
+  int h, events = 0;
 
 #if REACTOR_DEBUG
   fprintf (stderr,
 	   "reactor_unregister (handle=%d [fd=%d, ops=0x%x])\n",
-	   handle, poll_array[a].fd, poll_array[a].events);
+	   handle, hp->fd, hp->operations);
 #endif
 
-  handles[handle].offset = -1;
+  /* Unlink this handle from the list for this fd. */
+  if (hp->prev >= 0) handles[hp->prev].next = hp->next;
+  else f->head = hp->next;
+  if (hp->next >= 0) handles[hp->next].prev = hp->prev;
 
-  /* Does any other handle share this element? If so, leave POLL_ARRAY alone.
+  /* Recalculate the events needed by the remaining handles. */
+  for (h = f->head; h >= 0; h = handles[h].next)
+    events |= handles[h].operations;
+
+  if (f->attached)
+    f->events = events;
+  else if (events != f->events)
+    {
+      f->events = events;
+      update_fd (hp->fd);
+    }
+
+  /* Put the handle back on the free list. */
+  hp->fd = -1;
+  hp->serial++;
+  hp->next = free_handle;
+  free_handle = handle;
+}
+
+/* If events wanted by handle h have been seen on its (attached) fd,
+ * arrange for the handle to be called on the next reactor_invoke.
+ */
+static void
+check_pending (int h)
+{
+  int fd = handles[h].fd;
+
+  if (fds[fd].ready & (handles[h].operations | POLLERR | POLLHUP))
+    {
+      if (nr_pending >= nr_pending_allocated)
+	{
+	  nr_pending_allocated =
+	    nr_pending_allocated ? nr_pending_allocated * 2 : 8;
+	  pending = realloc (pending,
+			     nr_pending_allocated *
+			     sizeof (struct reactor_ready));
+	}
+      pending[nr_pending].handle = h;
+      pending[nr_pending].serial = handles[h].serial;
+      pending[nr_pending].fd = fd;
+      nr_pending++;
+    }
+}
+
+static void
+grow_fds (int fd)
+{
+  int i, n = nr_fds_allocated;
+
+  nr_fds_allocated = fd >= 2 * n ? fd + 1 : 2 * n;
+  fds = realloc (fds, nr_fds_allocated * sizeof (struct reactor_fd));
+  for (i = n; i < nr_fds_allocated; ++i)
+    {
+      fds[i].head = -1;
+      fds[i].events = 0;
+      fds[i].offset = -1;
+      fds[i].in_epoll = 0;
+      fds[i].attached = 0;
+      fds[i].ready = 0;
+    }
+}
+
+void
+reactor_attach_fd (pool pp, int fd)
+{
+#if REACTOR_EPOLL
+  struct reactor_fd *f;
+  struct epoll_event ev;
+
+  if (!backend_initialised) init_backend ();
+
+  /* With poll there is no kernel state to keep, so this does nothing. */
+  if (epoll_fd == -1) return;
+
+  if (fd >= nr_fds_allocated) grow_fds (fd);
+  f = &fds[fd];
+
+  if (f->attached == 0)
+    {
+      /* Descriptors which epoll refuses stay in POLL_ARRAY. */
+      if (f->offset >= 0) return;
+
+      memset (&ev, 0, sizeof ev);
+      ev.events = REACTOR_ATTACHED_EVENTS | EPOLLET;
+      ev.data.fd = fd;
+
+      if (epoll_ctl (epoll_fd, f->in_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		     fd, &ev) == -1 &&
+	  (errno != ENOENT ||
+	   epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) &&
+	  (errno != EEXIST ||
+	   epoll_ctl (epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1))
+	return;
+
+      f->in_epoll = 1;
+      f->ready = 0;
+    }
+
+  f->attached++;
+  pool_register_cleanup_fn (pp, detach_fd, (void *) (long) fd);
+#endif
+}
+
+static void
+detach_fd (void *fdp)
+{
+  int fd = (long) fdp;
+  struct reactor_fd *f = &fds[fd];
+
+  if (--f->attached > 0) return;
+
+  /* The fd has probably been closed already, which removes it from
+   * the epoll set, but just in case it hasn't ...
    */
-  for (i = 0; i < nr_handles_allocated; ++i)
-    if (handles[i].offset == a)
+#if REACTOR_EPOLL
+  if (f->in_epoll)
+    epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fd, 0);
+#endif
+  f->in_epoll = 0;
+  f->ready = 0;
+
+  /* If handles are still registered, go back to the ordinary scheme. */
+  if (f->events) update_fd (fd);
+}
+
+/* Pass the changed set of events for fd to the kernel. */
+static void
+update_fd (int fd)
+{
+  struct reactor_fd *f = &fds[fd];
+  int a;
+
+#if REACTOR_EPOLL
+  if (epoll_fd >= 0 && f->offset == -1)
+    {
+      struct epoll_event ev;
+
+      if (f->events == 0)
+	{
+	  /* This fails if the fd has already been closed, which is OK. */
+	  if (f->in_epoll)
+	    epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fd, 0);
+	  f->in_epoll = 0;
+	  return;
+	}
+
+      /* On Linux the EPOLL* event bits are the same as the POLL* bits. */
+      memset (&ev, 0, sizeof ev);
+      ev.events = f->events;
+      ev.data.fd = fd;
+
+      if (epoll_ctl (epoll_fd, f->in_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+		     fd, &ev) == 0 ||
+	  /* The fd was closed and reopened behind our back. */
+	  (errno == ENOENT &&
+	   epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) ||
+	  (errno == EEXIST &&
+	   epoll_ctl (epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0))
+	{
+	  f->in_epoll = 1;
+	  return;
+	}
+
+      /* epoll refuses some descriptors (EPERM for regular files), and
+       * EBADF should be reported to the handler as POLLNVAL, so fall
+       * through and let poll deal with this fd.
+       */
+      f->in_epoll = 0;
+    }
+#endif
+
+  if (f->events == 0)
+    {
+      /* Remove the fd from POLL_ARRAY, moving the last element into
+       * the hole.
+       */
+      a = f->offset;
+      if (a >= 0)
+	{
+	  nr_array_used--;
+	  if (a < nr_array_used)
+	    {
+	      poll_array[a] = poll_array[nr_array_used];
+	      fds[poll_array[a].fd].offset = a;
+	    }
+	  f->offset = -1;
+	}
       return;
+    }
 
-  /* Not shared. Remove this element from poll_array. */
-  memcpy (&poll_array[a], &poll_array[a+1],
-	  (nr_array_used - a - 1) * sizeof (struct pollfd));
-  nr_array_used --;
+  if (f->offset == -1)
+    {
+      /* Allocate space in the array of poll descriptors. */
+      if (nr_array_used >= nr_array_allocated)
+	{
+	  nr_array_allocated = nr_array_allocated ? nr_array_allocated * 2 : 8;
+	  poll_array = realloc (poll_array,
+				nr_array_allocated * sizeof (struct pollfd));
+	}
+      a = f->offset = nr_array_used++;
+      poll_array[a].fd = fd;
+      poll_array[a].revents = 0;
+    }
 
-  /* Any handles in used which use offset > a should be updated. */
-  for (i = 0; i < nr_handles_allocated; ++i)
-    if (handles[i].offset > a)
-      handles[i].offset --;
+  poll_array[f->offset].events = f->events;
+}
+
+/* Append the handles on fd which are interested in revents to READY. */
+static inline int
+collect_ready (int fd, int revents, int n)
+{
+  struct reactor_fd *f = &fds[fd];
+  int h, e;
+
+  /* For attached fds, remember the edge and deliver any events seen. */
+  if (f->attached)
+    revents = f->ready |= revents;
+
+  for (h = f->head; h >= 0; h = handles[h].next)
+    {
+      e = revents & (handles[h].operations | POLLERR | POLLHUP | POLLNVAL);
+      if (e)
+	{
+	  ready[n].handle = h;
+	  ready[n].serial = handles[h].serial;
+	  ready[n].fd = fd;
+	  ready[n].revents = e;
+	  n++;
+	  f->ready &= ~(e & ~(POLLERR | POLLHUP));
+	}
+    }
+
+  return n;
 }
 
 reactor_timer
@@ -298,8 +700,7 @@ reactor_set_timer (pool pp,
 		   void *data)
 {
   pool sp;
-  reactor_timer timer, p, last_p;
-  unsigned long long trigger_time, this_time;
+  reactor_timer timer;
 
   sp = new_subpool (pp);
 
@@ -308,66 +709,89 @@ reactor_set_timer (pool pp,
   timer->pool = sp;
   timer->fn = fn;
   timer->data = data;
+  timer->expires = reactor_time + timeout;
 
   /* Register a function to clean up this timer when the subpool is deleted.*/
   pool_register_cleanup_fn (sp, remove_timer, timer);
 
-  /* Calculate the trigger time. */
-  trigger_time = reactor_time + timeout;
+  add_timer (timer);
+  nr_timers++;
 
-  if (head_timer == 0)		/* List is empty. */
-    {
-      timer->prev = timer->next = 0;
-      timer->delta = trigger_time;
-      return head_timer = timer;
-    }
+  return timer;
+}
+
+/* Put timer into the right slot for its expiry time. */
+static void
+add_timer (reactor_timer timer)
+{
+  reactor_time_t delta;
+  int l, slot;
+  struct reactor_timer *head;
 
-  /* Find out where to insert this handle in the delta queue. */
-  this_time = 0;
-  last_p = 0;
-  for (p = head_timer; p; last_p = p, p = p->next)
+  if (timer->expires < wheel_time)
+    slot = WHEEL_EXPIRED;
+  else
     {
-      this_time += p->delta;
+      delta = timer->expires - wheel_time;
 
-      if (this_time >= trigger_time) /* Insert before element p. */
-	{
-	  timer->prev = p->prev;
-	  timer->next = p;
-	  if (p->prev)		/* Not the first element. */
-	    p->prev->next = timer;
-	  else			/* First element in list. */
-	    head_timer = timer;
-	  p->prev = timer;
-	  timer->delta = trigger_time - (this_time - p->delta);
-	  p->delta = this_time - trigger_time;
-	  return timer;
-	}
+      /* Find the lowest level which spans delta. Timers beyond the
+       * span of the top level are put in its furthest slot, and just
+       * get cascaded round again.
+       */
+      for (l = 0; l < WHEEL_LEVELS-1; ++l)
+	if (delta < 1ULL << (WHEEL_SHIFT (l+1)))
+	  break;
+
+      if (l == WHEEL_LEVELS-1 &&
+	  delta >= 1ULL << (WHEEL_SHIFT (l) + WHEEL_LN_BITS))
+	slot = ((wheel_time >> WHEEL_SHIFT (l)) - 1) &
+	  ((1 << WHEEL_LN_BITS) - 1);
+      else
+	slot = (timer->expires >> WHEEL_SHIFT (l)) &
+	  ((1 << (l == 0 ? WHEEL_L0_BITS : WHEEL_LN_BITS)) - 1);
+
+      slot += WHEEL_BASE (l);
+      wheel_bits[slot >> 6] |= 1ULL << (slot & 63);
     }
 
-  /* Insert at the end of the list. */
-  last_p->next = timer;
-  timer->prev = last_p;
-  timer->next = 0;
-  timer->delta = trigger_time - this_time;
-  return timer;
+  /* Append to the circular list in this slot. */
+  timer->slot = slot;
+  head = wheel[slot];
+  if (head == 0)
+    {
+      timer->prev = timer->next = timer;
+      wheel[slot] = timer;
+    }
+  else
+    {
+      timer->prev = head->prev;
+      timer->next = head;
+      head->prev->next = timer;
+      head->prev = timer;
+    }
 }
 
 static void
 remove_timer (void *timerp)
 {
   struct reactor_timer *timer = (struct reactor_timer *) timerp;
+  int slot = timer->slot;
 
-  /* Remove this timer from the list. */
-  if (timer->prev != 0)
-    timer->prev->next = timer->next;
+  /* Remove this timer from its slot. */
+  if (timer->next == timer)
+    {
+      wheel[slot] = 0;
+      if (slot != WHEEL_EXPIRED)
+	wheel_bits[slot >> 6] &= ~(1ULL << (slot & 63));
+    }
   else
-    head_timer = timer->next;
-
-  if (timer->next != 0)
     {
+      timer->prev->next = timer->next;
       timer->next->prev = timer->prev;
-      timer->next->delta += timer->delta;
+      if (wheel[slot] == timer) wheel[slot] = timer->next;
     }
+
+  nr_timers--;
 }
 
 void
@@ -391,6 +815,7 @@ reactor_register_prepoll (pool pp,
   p->pool = sp;
   p->fn = fn;
   p->data = data;
+  p->fired = 0;
 
   pool_register_cleanup_fn (sp, remove_prepoll, p);
 
@@ -426,10 +851,209 @@ reactor_unregister_prepoll (reactor_prepoll handle)
   delete_pool (handle->pool);
 }
 
+void
+reactor_schedule (struct reactor_runnable *r)
+{
+  if (r->next) return;		/* Already scheduled. */
+
+  r->prev = run_queue.prev;
+  r->next = &run_queue;
+  run_queue.prev->next = r;
+  run_queue.prev = r;
+}
+
+void
+reactor_unschedule (struct reactor_runnable *r)
+{
+  if (!r->next) return;		/* Not scheduled, or already run. */
+
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  r->prev = r->next = 0;
+}
+
+/* Run everything on the run queue, including entries which are
+ * scheduled while we do so. Each entry is unlinked before its function
+ * is called, so the function may reschedule it or free it.
+ */
+static void
+run_run_queue (void)
+{
+  struct reactor_runnable *r;
+
+  while ((r = run_queue.next) != &run_queue)
+    {
+      reactor_unschedule (r);
+      r->fn (r->data);
+    }
+}
+
+/* Return the first set bit in bits at or after start, or -1 if none. */
+static inline int
+find_bit (const unsigned long long *bits, int nr_words, int start)
+{
+  int w = start >> 6;
+  unsigned long long word;
+
+  if (w >= nr_words) return -1;
+  word = bits[w] & (~0ULL << (start & 63));
+
+  for (;;)
+    {
+      if (word) return (w << 6) + __builtin_ctzll (word);
+      if (++w >= nr_words) return -1;
+      word = bits[w];
+    }
+}
+
+/* Return the number of positions after start (wrapping round) of the
+ * first set bit in the 64 bit word, or -1 if none.
+ */
+static inline int
+find_bit_wrap (unsigned long long word, int start)
+{
+  if (word == 0) return -1;
+  if (start) word = (word >> start) | (word << (64 - start));
+  return __builtin_ctzll (word);
+}
+
+/* Return the first tick at or after t at which there may be something
+ * to do (a non-empty slot in level 0, or a cascade), but no later than
+ * limit.
+ */
+static reactor_time_t
+next_timer_tick (reactor_time_t t, reactor_time_t limit)
+{
+  const reactor_time_t mask = (1 << WHEEL_L0_BITS) - 1;
+  int slot;
+
+  /* Always stop at a cascade. */
+  if ((t & mask) == 0) return t < limit ? t : limit;
+
+  slot = find_bit (wheel_bits, (1 << WHEEL_L0_BITS) / 64, t & mask);
+  if (slot >= 0)
+    t = (t & ~mask) | slot;
+  else
+    t = (t | mask) + 1;
+
+  return t < limit ? t : limit;
+}
+
+/* Return the time at which poll should next wake up to run timers,
+ * or 0 if there are no timers.
+ */
+static reactor_time_t
+next_timer_expiry (void)
+{
+  const reactor_time_t mask = (1 << WHEEL_L0_BITS) - 1;
+  reactor_time_t t, best, epoch;
+  int l, k, slot;
+
+  if (wheel[WHEEL_EXPIRED]) return reactor_time;
+  if (nr_timers == 0) return 0;
+
+  /* A cascade is due, which might bring down a timer for any time. */
+  if ((wheel_time & mask) == 0) return wheel_time;
+
+  /* A timer in level 0 which expires before the next cascade? */
+  slot = find_bit (wheel_bits, (1 << WHEEL_L0_BITS) / 64,
+		   wheel_time & mask);
+  if (slot >= 0) return (wheel_time & ~mask) | slot;
+
+  /* Otherwise the earliest of: level 0 timers in the next rotation,
+   * and the next cascade of a non-empty slot in each higher level.
+   */
+  best = ~0ULL;
+  slot = find_bit (wheel_bits, (1 << WHEEL_L0_BITS) / 64, 0);
+  if (slot >= 0) best = ((wheel_time | mask) + 1) | slot;
+
+  for (l = 1; l < WHEEL_LEVELS; ++l)
+    {
+      /* The cascade for the current epoch of this level has already
+       * happened, unless we are exactly at the start of it.
+       */
+      epoch = wheel_time >> WHEEL_SHIFT (l);
+      if (wheel_time & ((1ULL << WHEEL_SHIFT (l)) - 1)) epoch++;
+
+      k = find_bit_wrap (wheel_bits[WHEEL_BASE (l) / 64],
+			 epoch & ((1 << WHEEL_LN_BITS) - 1));
+      if (k >= 0)
+	{
+	  t = (epoch + k) << WHEEL_SHIFT (l);
+	  if (t < best) best = t;
+	}
+    }
+
+  return best;
+}
+
+/* Fire timer (removing it first). */
+static inline void
+fire_timer (reactor_timer timer)
+{
+  void (*fn) (void *) = timer->fn;
+  void *data = timer->data;
+
+  /* Remove the timer from the queue now (this avoids a rare race
+   * condition exposed if code calls pth_sleep followed immediately
+   * by pth_exit).
+   */
+  reactor_unset_timer_early (timer);
+
+  fn (data);
+}
+
+/* Move all the timers in a slot to their new slots. */
+static void
+cascade (int slot)
+{
+  reactor_timer timer;
+
+  while ((timer = wheel[slot]) != 0)
+    {
+      remove_timer (timer);
+      nr_timers++;
+      add_timer (timer);
+    }
+}
+
+/* Fire all timers which are due, and bring WHEEL_TIME up to date. */
+static void
+run_timers ()
+{
+  const reactor_time_t mask = (1 << WHEEL_L0_BITS) - 1;
+  int l, slot, index;
+
+  while (wheel[WHEEL_EXPIRED])
+    fire_timer (wheel[WHEEL_EXPIRED]);
+
+  while (wheel_time <= reactor_time)
+    {
+      slot = wheel_time & mask;
+
+      /* Cascade timers down from the higher levels. */
+      if (slot == 0)
+	for (l = 1; l < WHEEL_LEVELS; ++l)
+	  {
+	    index = (wheel_time >> WHEEL_SHIFT (l)) &
+	      ((1 << WHEEL_LN_BITS) - 1);
+	    cascade (WHEEL_BASE (l) + index);
+	    if (index != 0) break;
+	  }
+
+      /* Calling fn might add or remove timers in this slot. */
+      while (wheel[slot])
+	fire_timer (wheel[slot]);
+
+      wheel_time = next_timer_tick (wheel_time + 1, reactor_time + 1);
+    }
+}
+
 void
 reactor_invoke ()
 {
-  int i, r, a;
+  int i, r, n, timeout;
+  reactor_time_t expiry;
   reactor_prepoll prepoll;
   struct timeval tv;
 
@@ -440,25 +1064,10 @@ reactor_invoke ()
 #endif
 
   /* Fire any timers which are ready. */
-  while (head_timer != 0 && head_timer->delta <= reactor_time)
-    {
-      reactor_timer timer;
-      void (*fn) (void *);
-      void *data;
-
-      /* Calling fn might change head_timer. */
-      timer = head_timer;
-      fn = timer->fn;
-      data = timer->data;
-
-      /* Remove the timer from the queue now (this avoids a rare race
-       * condition exposed if code calls pth_sleep followed immediately
-       * by pth_exit).
-       */
-      reactor_unset_timer_early (timer);
+  run_timers ();
 
-      fn (data);
-    }
+  /* Run the threads which have been made runnable. */
+  run_run_queue ();
 
   /* Run the prepoll handlers. This is tricky -- we have to check
    * (a) that we run every prepoll handler, even if new ones are
@@ -488,69 +1097,121 @@ reactor_invoke ()
     }
 
   /* Poll file descriptors. */
-  if (nr_array_used >= 0)
-    {
+  if (!backend_initialised) init_backend ();
+
+  expiry = next_timer_expiry ();
+  if (expiry == 0)
+    timeout = -1;
+  else if (expiry <= reactor_time)
+    timeout = 0;
+  else if (expiry - reactor_time > INT_MAX)
+    timeout = INT_MAX;
+  else
+    timeout = expiry - reactor_time;
+
+  /* Prepoll handlers may have scheduled more work. */
+  if (run_queue.next != &run_queue) timeout = 0;
+
 #if REACTOR_DEBUG
-      fprintf (stderr, "reactor_invoke: poll [");
-      for (i = 0; i < nr_array_used; ++i)
-	fprintf (stderr, "(fd=%d, ops=0x%x)",
-		 poll_array[i].fd, poll_array[i].events);
-      fprintf (stderr, "]\n");
+  fprintf (stderr, "reactor_invoke: %s [", epoll_fd >= 0 ? "epoll" : "poll");
+  for (i = 0; i < nr_array_used; ++i)
+    fprintf (stderr, "(fd=%d, ops=0x%x)",
+	     poll_array[i].fd, poll_array[i].events);
+  fprintf (stderr, "]\n");
 #endif
 
-      r = poll (poll_array, nr_array_used,
-		head_timer ? head_timer->delta - reactor_time : -1);
+  n = 0;
+#if REACTOR_EPOLL
+  if (epoll_fd >= 0)
+    {
+      static struct epoll_event events[REACTOR_MAX_EVENTS];
 
-      /* Update the reactor time. */
-      gettimeofday (&tv, 0);
-      reactor_time = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+      /* Descriptors in POLL_ARRAY are always ready, and handles in
+       * PENDING can be called straightaway, so don't wait.
+       */
+      if (nr_array_used > 0 || nr_pending > 0) timeout = 0;
 
-#if REACTOR_DEBUG
-      fprintf (stderr, "reactor_invoke: poll returned %d [", r);
+      r = epoll_wait (epoll_fd, events, REACTOR_MAX_EVENTS, timeout);
+
+      for (i = 0; i < r; ++i)
+	n = collect_ready (events[i].data.fd, events[i].events, n);
+
+      /* Handles registered on attached fds after the event was seen. */
+      for (i = 0; i < nr_pending; ++i)
+	{
+	  struct reactor_handle *hp = &handles[pending[i].handle];
+	  struct reactor_fd *f = &fds[pending[i].fd];
+	  int e;
+
+	  if (hp->fd < 0 || hp->serial != pending[i].serial) continue;
+
+	  e = f->ready & (hp->operations | POLLERR | POLLHUP);
+	  if (e)
+	    {
+	      ready[n] = pending[i];
+	      ready[n].revents = e;
+	      n++;
+	      f->ready &= ~(e & ~(POLLERR | POLLHUP));
+	      if (r < 0) r = 0;
+	      r++;
+	    }
+	}
+      nr_pending = 0;
+
+      if (nr_array_used > 0)
+	{
+	  int r2 = poll (poll_array, nr_array_used, 0);
+
+	  if (r2 > 0)
+	    {
+	      if (r < 0) r = 0;
+	      r += r2;
+	    }
+	}
+    }
+  else
+#endif
+    r = poll (poll_array, nr_array_used, timeout);
+
+  /* Update the reactor time. */
+  gettimeofday (&tv, 0);
+  reactor_time = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+
+  if (r > 0)			/* Some descriptors are ready. */
+    {
       for (i = 0; i < nr_array_used; ++i)
 	if (poll_array[i].revents != 0)
-	  fprintf (stderr, "(fd=%d, ops=0x%x)",
-		   poll_array[i].fd, poll_array[i].revents);
+	  n = collect_ready (poll_array[i].fd, poll_array[i].revents, n);
+
+#if REACTOR_DEBUG
+      fprintf (stderr, "reactor_invoke: returned %d [", r);
+      for (i = 0; i < n; ++i)
+	fprintf (stderr, "(handle=%d, fd=%d, ops=0x%x)",
+		 ready[i].handle, handles[ready[i].handle].fd,
+		 ready[i].revents);
       fprintf (stderr, "]\n");
 #endif
 
-      if (r > 0)		/* Some descriptors are ready. */
+      /* Calling fn can register/unregister handles, so check that
+       * each handle is still the one we collected before calling it.
+       */
+      for (i = 0; i < n; ++i)
 	{
-	  /* Check for events happening in the array, but go via the
-	   * handles because there is no back pointer back to the
-	   * handles from the array. Surprisingly enough, this code
-	   * appears to be free of race conditions (note that calling
-	   * fn can register/unregister handles).
-	   */
-	  for (i = 0; i < nr_handles_allocated; ++i)
+	  struct reactor_handle *hp = &handles[ready[i].handle];
+
+	  if (hp->fd >= 0 && hp->serial == ready[i].serial)
+	    hp->fn (hp->fd, ready[i].revents, hp->data);
+	  else if (fds[ready[i].fd].attached)
 	    {
-	      a = handles[i].offset;
+	      int h;
 
-	      if (a >= 0 && poll_array[a].revents != 0)
-		{
-		  handles[i].fn (poll_array[a].fd, poll_array[a].revents,
-				 handles[i].data);
-		}
+	      /* Nobody took the event, so don't lose it. */
+	      fds[ready[i].fd].ready |= ready[i].revents;
+	      for (h = fds[ready[i].fd].head; h >= 0; h = handles[h].next)
+		check_pending (h);
 	    }
 	}
-      else if (r == 0)		/* The head timer has fired. */
-	{
-	  reactor_timer timer;
-	  void (*fn) (void *);
-	  void *data;
-
-	  /* Calling fn might change head_timer. */
-	  timer = head_timer;
-	  fn = timer->fn;
-	  data = timer->data;
-
-	  /* Remove the timer from the queue now (this avoids a rare race
-	   * condition exposed if code calls pth_sleep followed immediately
-	   * by pth_exit).
-	   */
-	  reactor_unset_timer_early (timer);
-
-	  fn (data);
-	}
     }
+  else if (r == 0)		/* Timers may be ready to fire. */
+    run_timers ();
 }
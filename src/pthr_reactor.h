@@ -39,6 +39,18 @@ typedef struct reactor_timer *reactor_timer;
 struct reactor_prepoll;
 typedef struct reactor_prepoll *reactor_prepoll;
 
+/* An entry on the run queue. The caller allocates this (usually as
+ * part of some larger structure), sets the links to null before it
+ * is first scheduled, and must not free it while it is scheduled. The
+ * links are otherwise private to the reactor.
+ */
+struct reactor_runnable
+{
+  struct reactor_runnable *prev, *next;
+  void (*fn) (void *data);
+  void *data;
+};
+
 /* Reactor operations. */
 #define REACTOR_READ  POLLIN
 #define REACTOR_WRITE POLLOUT
@@ -50,12 +62,38 @@ typedef signed long long reactor_timediff_t;
 /* Reactor time in milliseconds from Unix epoch. */
 extern reactor_time_t reactor_time;
 
-/* Reactor functions. */
+/* Reactor functions.
+ *
+ * Registering and unregistering handles are constant-time operations.
+ * Several handles may be registered on the same file descriptor. On
+ * systems which have epoll(7) the reactor uses it, so that the cost of
+ * reactor_invoke depends on the number of ready descriptors rather than
+ * on the number registered. Set PTHRLIB_REACTOR=poll in the environment
+ * to force the reactor to use poll(2) instead.
+ *
+ * reactor_attach_fd keeps socket in the kernel's interest set
+ * (edge-triggered, for all events) until pool is deleted, which must
+ * happen before or when socket is closed. While it is attached,
+ * registering and unregistering handles on socket cost no system calls.
+ * Only register a handle on an attached socket after a read or write
+ * on it has failed with EAGAIN (as the pth_* functions do), since a
+ * handle is only called for readiness which arrives after that.
+ * io_fdopen attaches the socket of each I/O handle.
+ *
+ * reactor_schedule appends an entry to the run queue, and
+ * reactor_unschedule removes it again if it has not run yet. Both are
+ * constant-time and allocate nothing. Each reactor_invoke calls the
+ * functions on the run queue in order (including entries scheduled
+ * while it does so) before it polls, and it does not block in poll
+ * while the run queue is not empty. Scheduling an entry which is
+ * already scheduled does nothing.
+ */
 extern reactor_handle reactor_register (int socket, int operations,
 					void (*fn) (int socket, int events,
 						    void *data),
 					void *data);
 extern void reactor_unregister (reactor_handle handle);
+extern void reactor_attach_fd (pool, int socket);
 extern reactor_timer reactor_set_timer (pool, int timeout,
 					void (*fn) (void *data),
 					void *data);
@@ -63,6 +101,8 @@ extern void reactor_unset_timer_early (reactor_timer timer);
 extern reactor_prepoll reactor_register_prepoll (pool, void (*fn) (void *data),
 						 void *data);
 extern void reactor_unregister_prepoll (reactor_prepoll handle);
+extern void reactor_schedule (struct reactor_runnable *r);
+extern void reactor_unschedule (struct reactor_runnable *r);
 extern void reactor_invoke (void);
 
 #endif /* PTHR_REACTOR_H */
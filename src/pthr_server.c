@@ -71,6 +71,14 @@
 #include <signal.h>
 #endif
 
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
 #include "pthr_listener.h"
 #include "pthr_server.h"
 
@@ -88,6 +96,15 @@ static const char *username = 0;
 static const char *stderr_file = 0;
 static void (*startup_fn)(int argc, char *argv[]) = 0;
 static int enable_stack_trace_on_segv = 0;
+static int nr_workers = 1;
+static int worker_number = 0;
+static int listen_backlog = SOMAXCONN;
+static int max_connections = 0;
+static int queue_size = 0;
+static int queue_mode = LISTENER_FIFO;
+
+/* Maximum number of worker processes. */
+#define MAX_WORKERS 1024
 
 #if defined(HAVE_EXECINFO_H) && defined(HAVE_BACKTRACE)
 #define CAN_CATCH_SIGSEGV
@@ -97,6 +114,13 @@ static int enable_stack_trace_on_segv = 0;
 static void catch_sigsegv (int);
 #endif
 
+static int open_listening_socket (in_addr_t address, int port, int reuseport);
+static int run_workers (int *socks, int nr_socks);
+static void catch_worker_quit_signal (int);
+static void catch_worker_hup_signal (int);
+static volatile sig_atomic_t workers_quit = 0;
+static volatile sig_atomic_t workers_hup = 0;
+
 extern char *optarg;
 extern int optind;
 extern int opterr;
@@ -113,12 +137,12 @@ void
 pthr_server_main_loop (int argc, char *argv[],
 		       void (*processor_fn) (int sock, void *))
 {
-  struct sockaddr_in addr;
   int port = default_port;
   in_addr_t address = default_address;
-  int sock, one = 1;
+  int socks[MAX_WORKERS], nr_socks = 1, sock, i;
   int c;
   char getopt_scr[10];
+  listener l;
 
   /* Reset the getopt library. */
   optind = 1;
@@ -158,28 +182,27 @@ pthr_server_main_loop (int argc, char *argv[],
 	}
     }
 
-  /* Bind a socket to the appropriate port. */
-  sock = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (sock < 0) abort ();
-
-  setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
-
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = address;
-  addr.sin_port = htons (port);
-  if (bind (sock, (struct sockaddr *) &addr, sizeof addr) < 0)
+  /* Work out how many worker processes to run. */
+  if (nr_workers <= 0)
     {
-      /* Generally this means that the port is already bound. */
-      perror ("bind");
-      exit (1);
+#ifdef _SC_NPROCESSORS_ONLN
+      nr_workers = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+      if (nr_workers <= 0) nr_workers = 1;
     }
+  if (nr_workers > MAX_WORKERS) nr_workers = MAX_WORKERS;
 
-  /* Put the socket into listen mode. */
-  if (listen (sock, 10) < 0) abort ();
-
-  /* Set the new socket to non-blocking. */
-  if (fcntl (sock, F_SETFL, O_NONBLOCK) < 0) abort ();
+  /* Bind a socket to the appropriate port. If there are several workers
+   * and the system supports it, give each worker its own socket and let
+   * the kernel share out connections between them. Otherwise they all
+   * share one socket.
+   */
+#ifdef SO_REUSEPORT
+  nr_socks = nr_workers;
+#endif
+  for (i = 0; i < nr_socks; ++i)
+    socks[i] = open_listening_socket (address, port, nr_socks > 1);
+  sock = socks[0];
 
   /* If running as root, and asked to chroot, then chroot. */
   if (root && geteuid () == 0)
@@ -271,18 +294,209 @@ pthr_server_main_loop (int argc, char *argv[],
 #endif
     }
 
+  /* Fork the worker processes. The parent process waits here until
+   * all the workers have exited. Each worker carries on below.
+   */
+  if (nr_workers > 1)
+    {
+      worker_number = run_workers (socks, nr_socks);
+      if (worker_number == -1)
+	return;
+
+      sock = socks[worker_number % nr_socks];
+      for (i = 0; i < nr_socks; ++i)
+	if (socks[i] != sock && socks[i] >= 0)
+	  close (socks[i]);
+    }
+
   /* Run the startup function, if any. */
   if (startup_fn)
     startup_fn (argc, argv);
 
   /* Start the listener thread. */
-  (void) new_listener (sock, processor_fn, 0);
+  l = new_listener (sock, processor_fn, 0);
+  if (max_connections > 0)
+    listener_set_max_connections (l, max_connections);
+  if (queue_size > 0)
+    listener_set_queue (l, queue_size, queue_mode);
 
   /* Run the reactor. */
   while (pseudothread_count_threads () > 0)
     reactor_invoke ();
 }
 
+static int
+open_listening_socket (in_addr_t address, int port, int reuseport)
+{
+  struct sockaddr_in addr;
+  int sock, one = 1;
+
+  sock = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock < 0) abort ();
+
+  setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+#ifdef SO_REUSEPORT
+  if (reuseport &&
+      setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) < 0)
+    {
+      perror ("setsockopt: SO_REUSEPORT");
+      exit (1);
+    }
+#endif
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = address;
+  addr.sin_port = htons (port);
+  if (bind (sock, (struct sockaddr *) &addr, sizeof addr) < 0)
+    {
+      /* Generally this means that the port is already bound. */
+      perror ("bind");
+      exit (1);
+    }
+
+  /* Put the socket into listen mode. */
+  if (listen (sock, listen_backlog) < 0) abort ();
+
+  /* Set the new socket to non-blocking. */
+  if (fcntl (sock, F_SETFL, O_NONBLOCK) < 0) abort ();
+
+  return sock;
+}
+
+/* Fork NR_WORKERS worker processes. In each worker, this returns the
+ * worker number. The parent process stays in here, restarting any
+ * worker which dies from a signal, until all the workers have exited
+ * or the parent is asked to quit. Then it returns -1.
+ *
+ * Worker i listens on SOCKS[i % NR_SOCKS]. When no worker is left
+ * which could listen on a socket, the parent closes it, so that the
+ * kernel stops handing it connections which nobody would accept.
+ */
+static int
+run_workers (int *socks, int nr_socks)
+{
+  pid_t pids[MAX_WORKERS], pid;
+  int i, j, status, nr_running = 0;
+  struct sigaction sa, old_int, old_quit, old_term, old_hup;
+
+  /* The workers keep whatever signal handlers the program installed.
+   * The parent catches the quit signals and SIGHUP so it can pass
+   * them on.
+   */
+  memset (&sa, 0, sizeof sa);
+  sa.sa_handler = catch_worker_quit_signal;
+  sa.sa_flags = 0;
+  sigaction (SIGINT, &sa, &old_int);
+  sigaction (SIGQUIT, &sa, &old_quit);
+  sigaction (SIGTERM, &sa, &old_term);
+  sa.sa_handler = catch_worker_hup_signal;
+  sigaction (SIGHUP, &sa, &old_hup);
+
+  for (i = 0; i < nr_workers; ++i)
+    pids[i] = 0;
+
+  for (;;)
+    {
+      /* Start any workers which aren't running. */
+      for (i = 0; !workers_quit && i < nr_workers; ++i)
+	if (pids[i] == 0)
+	  {
+	    pid = fork ();
+	    if (pid == 0)	/* Worker. */
+	      {
+		sigaction (SIGINT, &old_int, 0);
+		sigaction (SIGQUIT, &old_quit, 0);
+		sigaction (SIGTERM, &old_term, 0);
+		sigaction (SIGHUP, &old_hup, 0);
+		return i;
+	      }
+	    else if (pid > 0)
+	      {
+		pids[i] = pid;
+		nr_running++;
+	      }
+	    else
+	      {
+		if (!disable_syslog) syslog (LOG_ERR, "fork: %m");
+		sleep (1);
+	      }
+	  }
+
+      if (nr_running == 0) break;
+
+      if (workers_quit == 1)
+	{
+	  /* Pass the quit signal on to the workers. */
+	  workers_quit = 2;
+	  for (i = 0; i < nr_workers; ++i)
+	    if (pids[i] > 0) kill (pids[i], SIGTERM);
+	}
+
+      if (workers_hup)
+	{
+	  workers_hup = 0;
+	  for (i = 0; i < nr_workers; ++i)
+	    if (pids[i] > 0) kill (pids[i], SIGHUP);
+	}
+
+      pid = waitpid (-1, &status, 0);
+      if (pid == -1)
+	{
+	  if (errno == EINTR) continue;
+	  break;
+	}
+
+      for (i = 0; i < nr_workers; ++i)
+	if (pids[i] == pid)
+	  {
+	    nr_running--;
+	    pids[i] = 0;
+
+	    /* A worker which exited normally is not restarted. */
+	    if (WIFSIGNALED (status) && !workers_quit)
+	      {
+		if (!disable_syslog)
+		  syslog (LOG_ERR, "worker %d (pid %d) killed by signal %d",
+			  i, (int) pid, WTERMSIG (status));
+		sleep (1);
+	      }
+	    else
+	      {
+		pids[i] = -1;
+
+		for (j = i % nr_socks; j < nr_workers; j += nr_socks)
+		  if (pids[j] != -1)
+		    break;
+		if (j >= nr_workers && socks[i % nr_socks] >= 0)
+		  {
+		    close (socks[i % nr_socks]);
+		    socks[i % nr_socks] = -1;
+		  }
+	      }
+	  }
+    }
+
+  sigaction (SIGINT, &old_int, 0);
+  sigaction (SIGQUIT, &old_quit, 0);
+  sigaction (SIGTERM, &old_term, 0);
+  sigaction (SIGHUP, &old_hup, 0);
+
+  return -1;
+}
+
+static void
+catch_worker_quit_signal (int sig)
+{
+  if (!workers_quit) workers_quit = 1;
+}
+
+static void
+catch_worker_hup_signal (int sig)
+{
+  workers_hup = 1;
+}
+
 #ifdef CAN_CATCH_SIGSEGV
 static void
 catch_sigsegv (int sig)
@@ -387,3 +601,34 @@ pthr_server_enable_stack_trace_on_segv (void)
 {
   enable_stack_trace_on_segv = 1;
 }
+
+void
+pthr_server_workers (int _nr_workers)
+{
+  nr_workers = _nr_workers;
+}
+
+int
+pthr_server_worker_number (void)
+{
+  return worker_number;
+}
+
+void
+pthr_server_listen_backlog (int _listen_backlog)
+{
+  listen_backlog = _listen_backlog;
+}
+
+void
+pthr_server_max_connections (int _max_connections)
+{
+  max_connections = _max_connections;
+}
+
+void
+pthr_server_connection_queue (int _queue_size, int _queue_mode)
+{
+  queue_size = _queue_size;
+  queue_mode = _queue_mode;
+}
@@ -25,6 +25,8 @@
 #include <netinet/in.h>
 #endif
 
+#include "pthr_listener.h"
+
 /* Function: pthr_server_main_loop - Enter server main loop.
  * Function: pthr_server_default_port
  * Function: pthr_server_port_option_name
@@ -40,6 +42,11 @@
  * Function: pthr_server_stderr_file
  * Function: pthr_server_startup_fn
  * Function: pthr_server_enable_stack_trace_on_segv
+ * Function: pthr_server_workers
+ * Function: pthr_server_worker_number
+ * Function: pthr_server_listen_backlog
+ * Function: pthr_server_max_connections
+ * Function: pthr_server_connection_queue
  *
  * The function @code{pthr_server_main_loop} is a helper function which
  * allows you to write very simple servers quickly using @code{pthrlib}.
@@ -103,6 +110,39 @@
  * esoteric GLIBC functions (if these functions don't exist, then this
  * setting does nothing). If the executable is linked with @code{-rdynamic}
  * then symbolic names will be given in the stack trace, if available.
+ *
+ * Because the reactor and the pseudothreads are per-process, a server
+ * normally only uses one CPU. Call @code{pthr_server_workers} to run
+ * several copies of the server in separate worker processes (if the
+ * argument is 0, one per online CPU). The workers are forked after
+ * all of the above operations, and each one then calls the
+ * @code{startup_fn} and runs its own listener and reactor. Where the
+ * system supports @code{SO_REUSEPORT}, each worker listens on its own
+ * socket and the kernel spreads new connections across them; otherwise
+ * the workers share a single listening socket. The original process
+ * stays behind to supervise: it restarts any worker which is killed
+ * by a signal (for instance, one which crashes), passes
+ * @code{SIGINT}, @code{SIGQUIT}, @code{SIGTERM} and @code{SIGHUP}
+ * on to the workers, and returns from @code{pthr_server_main_loop}
+ * once all of them have exited. @code{pthr_server_worker_number}
+ * returns the number of the current worker (from 0), which is
+ * useful in the @code{startup_fn}, for example to open a separate
+ * log file per worker.
+ *
+ * @code{pthr_server_listen_backlog} sets the length of the queue of
+ * connections waiting to be accepted (the @code{backlog} argument to
+ * @code{listen(2)}). The default is @code{SOMAXCONN}. The kernel may
+ * silently limit it further. If the queue overflows during a burst
+ * of new connections, clients have to retry, which is slow. See also
+ * @ref{listener_set_accept_batch(3)}.
+ *
+ * @code{pthr_server_max_connections} limits the number of connections
+ * which each worker handles at once, and
+ * @code{pthr_server_connection_queue} sets up a queue of connections
+ * waiting to start (@code{LISTENER_FIFO} or @code{LISTENER_LIFO}
+ * order). These are passed to the listener: see
+ * @ref{listener_set_max_connections(3)} and
+ * @ref{listener_set_queue(3)}.
  */
 extern void pthr_server_main_loop (int argc, char *argv[], void (*processor_fn) (int sock, void *));
 extern void pthr_server_default_port (int default_port);
@@ -119,5 +159,10 @@ extern void pthr_server_username (const char *username);
 extern void pthr_server_stderr_file (const char *pathname);
 extern void pthr_server_startup_fn (void (*startup_fn) (int argc, char *argv[]));
 extern void pthr_server_enable_stack_trace_on_segv (void);
+extern void pthr_server_workers (int nr_workers);
+extern int pthr_server_worker_number (void);
+extern void pthr_server_listen_backlog (int backlog);
+extern void pthr_server_max_connections (int max_connections);
+extern void pthr_server_connection_queue (int size, int mode);
 
 #endif /* PTHR_SERVER_H */
@@ -36,12 +36,31 @@
  *
  * On Linux we also allocate a guard page to protect against
  * stack overflow.
+ *
+ * Stacks are only reserved address space: the kernel allocates
+ * pages as the thread touches them (MAP_NORESERVE also stops large
+ * stacks counting against the overcommit limit). So a thread can be
+ * given a big stack cheaply, and mincore(2) tells us how deep into
+ * it the thread has been.
+ *
+ * Allocating a stack costs an mmap and an mprotect, and freeing it
+ * an munmap, so finished stacks are kept in a cache and reused. The
+ * cache is a LIFO array (so the most recently used, and hence most
+ * likely to be resident, stack is reused first). When it would grow
+ * beyond HIGH_WATER stacks, the oldest are freed until LOW_WATER
+ * remain. Optionally we tell the kernel that the pages of a cached
+ * stack are no longer needed, trading memory for page faults when
+ * the stack is reused.
  */
 
 #include "config.h"
 
 #include <stdlib.h>
 
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -54,10 +73,22 @@
 
 #define GUARD_PAGE_SIZE 8192
 
+/* Default cache water marks. */
+#define DEFAULT_LOW_WATER 16
+#define DEFAULT_HIGH_WATER 64
+
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
 static inline void *
 alloc_stack (int size)
 {
@@ -65,7 +96,7 @@ alloc_stack (int size)
 
   /* Allocate the actual stack memory. */
   base = mmap (0, size, PROT_READ|PROT_WRITE|PROT_EXEC,
-	       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_STACK, -1, 0);
   if (base == MAP_FAILED) return 0;
 
   /* Allocate a guard page right at the bottom of the stack. */
@@ -84,36 +115,172 @@ free_stack (void *base, int size)
 static void *pending_stack_base = 0;
 static int pending_stack_size = 0;
 
-void *
-_pth_get_stack (int size)
+/* The stack cache (see notes above). */
+struct cached_stack
 {
   void *base;
+  int size;
+};
+
+static struct cached_stack *cache = 0;
+static int nr_cached = 0;
+static int low_water = DEFAULT_LOW_WATER;
+static int high_water = DEFAULT_HIGH_WATER;
+static int release_pages = 0;
+static unsigned long hits = 0, misses = 0;
+
+/* Remove all but the newest n stacks from the cache. */
+static void
+trim_cache (int n)
+{
+  int i, nr_freed;
+
+  if (nr_cached <= n) return;
+
+  nr_freed = nr_cached - n;
+  for (i = 0; i < nr_freed; ++i)
+    free_stack (cache[i].base, cache[i].size);
+  memmove (&cache[0], &cache[nr_freed], n * sizeof (struct cached_stack));
+  nr_cached = n;
+}
+
+/* Move the pending stack (if any) into the cache. */
+static void
+cache_pending_stack (void)
+{
+  void *base = pending_stack_base;
+  int size = pending_stack_size;
+
+  if (!base) return;
+  pending_stack_base = 0;
 
-  /* Is there a stack waiting to be freed up? If so, free it now. */
-  if (pending_stack_base)
+  if (high_water <= 0)
     {
-      free_stack (pending_stack_base, pending_stack_size);
-      pending_stack_base = 0;
+      free_stack (base, size);
+      return;
     }
 
-  /* Allocate a stack of the appropriate size, if available. */
-  base = alloc_stack (size);
-  if (!base) return 0;
+#if defined(HAVE_MADVISE) && (defined(MADV_FREE) || defined(MADV_DONTNEED))
+  if (release_pages)
+    {
+      void *start = (char *) base + GUARD_PAGE_SIZE;
+      int len = size - GUARD_PAGE_SIZE;
 
-  return base;
+#ifdef MADV_FREE
+      /* MADV_FREE fails on kernels which don't have it. */
+      if (madvise (start, len, MADV_FREE) == -1)
+#endif
+	madvise (start, len, MADV_DONTNEED);
+    }
+#endif
+
+  if (cache == 0)
+    {
+      cache = malloc (high_water * sizeof (struct cached_stack));
+      if (cache == 0) abort ();
+    }
+
+  if (nr_cached >= high_water)
+    trim_cache (low_water < high_water ? low_water : high_water - 1);
+
+  cache[nr_cached].base = base;
+  cache[nr_cached].size = size;
+  nr_cached++;
+}
+
+void *
+_pth_get_stack (int size)
+{
+  int i;
+
+  /* Is there a stack waiting to be freed up? If so, cache it now. */
+  cache_pending_stack ();
+
+  /* Is there a cached stack of the right size? */
+  for (i = nr_cached - 1; i >= 0; --i)
+    if (cache[i].size == size)
+      {
+	void *base = cache[i].base;
+
+	memmove (&cache[i], &cache[i+1],
+		 (nr_cached - i - 1) * sizeof (struct cached_stack));
+	nr_cached--;
+	hits++;
+	return base;
+      }
+
+  /* Allocate a stack of the appropriate size, if available. */
+  misses++;
+  return alloc_stack (size);
 }
 
 void
 _pth_return_stack (void *base, int size)
 {
-  /* Is there a stack waiting to be freed up? If so, free it now. */
-  if (pending_stack_base)
-    {
-      free_stack (pending_stack_base, pending_stack_size);
-      pending_stack_base = 0;
-    }
+  /* Is there a stack waiting to be freed up? If so, cache it now. */
+  cache_pending_stack ();
 
   /* Don't actually free the stack right now. We're still using it. */
   pending_stack_base = base;
   pending_stack_size = size;
 }
+
+void
+pseudothread_set_stack_cache (int _low_water, int _high_water,
+			      int _release_pages)
+{
+  if (_high_water < 0) _high_water = 0;
+  if (_low_water > _high_water) _low_water = _high_water;
+  if (_low_water < 0) _low_water = 0;
+
+  trim_cache (_high_water);
+  cache = realloc (cache, (_high_water ? _high_water : 1)
+		   * sizeof (struct cached_stack));
+  if (cache == 0) abort ();
+
+  low_water = _low_water;
+  high_water = _high_water;
+  release_pages = _release_pages;
+}
+
+void
+pseudothread_get_stack_cache_stats (unsigned long *_hits,
+				    unsigned long *_misses,
+				    int *_nr_cached)
+{
+  if (_hits) *_hits = hits;
+  if (_misses) *_misses = misses;
+  if (_nr_cached) *_nr_cached = nr_cached;
+}
+
+int
+_pth_stack_hwm (void *base, int size)
+{
+#if defined(HAVE_MINCORE) && defined(HAVE_GETPAGESIZE)
+  int page_size = getpagesize ();
+  int first = GUARD_PAGE_SIZE / page_size, nr_pages = size / page_size, i;
+#ifdef __linux__
+  unsigned char *vec;
+#else
+  char *vec;
+#endif
+
+  vec = malloc (nr_pages);
+  if (vec == 0) abort ();
+  if (mincore (base, nr_pages * page_size, vec) == -1)
+    {
+      free (vec);
+      return -1;
+    }
+
+  /* The stack grows down, so find the lowest page which has been used. */
+  for (i = first; i < nr_pages; ++i)
+    if (vec[i] & 1)
+      break;
+
+  free (vec);
+  return (nr_pages - i) * page_size;
+#else
+  return -1;
+#endif
+}
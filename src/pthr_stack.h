@@ -22,5 +22,32 @@
 
 extern void *_pth_get_stack (int size);
 extern void _pth_return_stack (void *, int size);
+extern int _pth_stack_hwm (void *base, int size);
+
+/* Function: pseudothread_set_stack_cache - control the cache of thread stacks
+ * Function: pseudothread_get_stack_cache_stats
+ *
+ * When a thread exits, its stack is kept in a cache so that it
+ * can be reused by the next thread created, avoiding the cost of
+ * mapping and unmapping the memory each time.
+ * @code{pseudothread_set_stack_cache} controls the size of
+ * this cache. When more than @code{high_water} stacks would be
+ * cached, the oldest are freed until only @code{low_water}
+ * remain. Setting @code{high_water} to 0 disables the cache.
+ * The defaults are 16 and 64. If @code{release_pages} is
+ * true, the pages of each cached stack are given back to the
+ * kernel (using @code{madvise(2)}), which saves memory
+ * when many threads exit at once, at the cost of page faults
+ * when the stack is reused.
+ *
+ * @code{pseudothread_get_stack_cache_stats} returns the number
+ * of stacks allocated from the cache (@code{hits}), the number
+ * which had to be allocated afresh (@code{misses}) and the number
+ * currently in the cache. Any of the pointers may be @code{NULL}.
+ *
+ * See also: @ref{pseudothread_set_stack_size(3)}.
+ */
+extern void pseudothread_set_stack_cache (int low_water, int high_water, int release_pages);
+extern void pseudothread_get_stack_cache_stats (unsigned long *hits, unsigned long *misses, int *nr_cached);
 
 #endif /* PTHR_STACK_H */
@@ -36,16 +36,28 @@
 #endif
 
 #include <pool.h>
-#include <vector.h>
 
+#include "pthr_reactor.h"
 #include "pthr_pseudothread.h"
 #include "pthr_wait_queue.h"
 
+/* A thread sleeping on a wait queue. This lives on the sleeping thread's
+ * own stack, so sleeping and waking allocate nothing.
+ */
+struct sleeper
+{
+  struct sleeper *prev, *next;	/* Links in the wait queue. */
+  struct reactor_runnable run;	/* Entry on the reactor run queue. */
+  pseudothread pth;
+  int woken;			/* Moved from the wait queue to run queue. */
+};
+
 /* See implementation notes in <pthr_wait_queue.h>. */
 struct wait_queue
 {
-  /* List of threads currently sleeping on the queue. */
-  vector sleepers;
+  /* List of threads currently sleeping on the queue, oldest first. */
+  struct sleeper *head, *tail;
+  int nr_sleepers;
 };
 
 wait_queue
@@ -53,14 +65,33 @@ new_wait_queue (pool pool)
 {
   wait_queue wq = pmalloc (pool, sizeof *wq);
 
-  wq->sleepers = new_vector (pool, pseudothread);
+  wq->head = wq->tail = 0;
+  wq->nr_sleepers = 0;
   return wq;
 }
 
 int
 wq_nr_sleepers (wait_queue wq)
 {
-  return vector_size (wq->sleepers);
+  return wq->nr_sleepers;
+}
+
+static inline void
+remove_sleeper (wait_queue wq, struct sleeper *s)
+{
+  if (s->prev) s->prev->next = s->next;
+  else wq->head = s->next;
+  if (s->next) s->next->prev = s->prev;
+  else wq->tail = s->prev;
+  wq->nr_sleepers--;
+}
+
+/* This is called from the reactor run queue to wake up the thread. */
+static void
+do_wake_up (void *pthv)
+{
+  /* Swap into the thread context. */
+  _pth_switch_calling_to_thread_context ((pseudothread) pthv);
 }
 
 /* To sleep on the wait queue, we register ourselves, then we swap back
@@ -69,7 +100,19 @@ wq_nr_sleepers (wait_queue wq)
 void
 wq_sleep_on (wait_queue wq)
 {
-  vector_push_back (wq->sleepers, current_pth);
+  struct sleeper s;
+
+  s.prev = wq->tail;
+  s.next = 0;
+  s.run.prev = s.run.next = 0;
+  s.run.fn = do_wake_up;
+  s.run.data = s.pth = current_pth;
+  s.woken = 0;
+
+  if (wq->tail) wq->tail->next = &s;
+  else wq->head = &s;
+  wq->tail = &s;
+  wq->nr_sleepers++;
 
   /* Swap context back to the calling context. */
   _pth_switch_thread_to_calling_context ();
@@ -79,110 +122,36 @@ wq_sleep_on (wait_queue wq)
   /* Have we been signalled? */
   if (_pth_alarm_received ())
     {
-      int i;
-      pseudothread p;
-
-      /* Remove self from sleepers list. */
-      for (i = 0; i < vector_size (wq->sleepers); ++i)
-	{
-	  vector_get (wq->sleepers, i, p);
-	  if (p == current_pth)
-	    {
-	      vector_erase (wq->sleepers, i);
-	      goto found;
-	    }
-	}
-
-      /* Oops - not found on sleepers list. */
-      abort ();
-
-    found:
+      /* We may still be on the sleepers list, or we may have been woken
+       * up already and be waiting on the run queue. Either way, S is
+       * about to disappear along with our stack, so unlink it.
+       */
+      if (!s.woken)
+	remove_sleeper (wq, &s);
+      else
+	reactor_unschedule (&s.run);
+
       /* Exit. */
       pth_exit ();
     }
 }
 
-/* This is the prepoll handler which actually wakes up the threads. */
-struct wake_up_info
-{
-  pool pool;
-  vector sleepers;		/* Pseudothreads to wake up. */
-  reactor_prepoll handler;	/* Handler (must be unregistered at end). */
-};
-
-static void
-do_wake_up (void *infop)
-{
-  struct wake_up_info *info = (struct wake_up_info *) infop;
-  int i;
-
-  for (i = 0; i < vector_size (info->sleepers); ++i)
-    {
-      pseudothread pth;
-
-      vector_get (info->sleepers, i, pth);
-
-      /* Swap into the thread context. */
-      _pth_switch_calling_to_thread_context (pth);
-    }
-
-  reactor_unregister_prepoll (info->handler);
-  delete_pool (info->pool);
-}
-
-/* To wake up we take a private copy of the wait queue, clear the
- * sleepers list, then register a prepoll handler which will eventually
- * run and wake up each sleeper in turn.
+/* To wake up we take sleepers off the front of the list and put them on
+ * the reactor run queue, which will eventually switch into each one in
+ * turn.
  */
 static inline void
 wake_up (wait_queue wq, int n)
 {
-  pool pool;
-  vector v;
-  reactor_prepoll handler;
-  struct wake_up_info *wake_up_info;
-
-  /* Added this experimentally to get around a bug when rws running monolith
-   * apps which have database connections open is killed. It seems to be
-   * something to do with having prepoll handlers registered when the
-   * reactor exits. Avoid this entirely here - there is no need, as far as
-   * I can see, to do anything in this function if no one is actually sleeping
-   * on the queue.
-   * - RWMJ 2002/10/15
-   */
-  if (vector_size (wq->sleepers) == 0) return;
-
-  /* This will be freed up by the prepoll handler. */
-  pool = new_subpool (global_pool);
+  struct sleeper *s;
 
-  /* Take a private copy, either of the whole queue, or just part of it,
-   * and also clear the list.
-   */
-  if (n == -1)
+  while (n != 0 && (s = wq->head) != 0)
     {
-      v = copy_vector (pool, wq->sleepers);
-      vector_clear (wq->sleepers);
+      remove_sleeper (wq, s);
+      s->woken = 1;
+      reactor_schedule (&s->run);
+      if (n > 0) n--;
     }
-  else
-    {
-      v = new_vector (pool, pseudothread);
-
-      while (n > 0)
-	{
-	  pseudothread pth;
-
-	  vector_pop_front (wq->sleepers, pth);
-	  vector_push_back (v, pth);
-	  n--;
-	}
-    }
-
-  /* Register a prepoll handler to wake up these sleepin' bewts. */
-  wake_up_info = pmalloc (pool, sizeof *wake_up_info);
-  wake_up_info->pool = pool;
-  wake_up_info->sleepers = v;
-  handler = reactor_register_prepoll (pool, do_wake_up, wake_up_info);
-  wake_up_info->handler = handler;
 }
 
 void
@@ -197,7 +166,7 @@ wq_wake_up_one (wait_queue wq)
   /* If there is nothing on the wait queue, but we were instructed to
    * wake one, then there is probably a bug in the code.
    */
-  if (vector_size (wq->sleepers) < 1) abort ();
+  if (wq->nr_sleepers < 1) abort ();
 
   wake_up (wq, 1);
 }
@@ -62,8 +62,11 @@ typedef struct wait_queue *wait_queue;
  * one pipe (ie. one inode, two file descriptors) per wait queue
  * made this implementation unacceptably heavyweight.
  *
- * Wait queues are now implemented using a simple hack in the reactor
- * which will be described below.
+ * Later, wait queues were implemented by registering a reactor prepoll
+ * handler for each wake-up, which allocated a pool and a copy of the
+ * list of sleepers every time. They now use the reactor run queue,
+ * as described below, and waking a thread costs constant time and
+ * no allocation.
  *
  * Wait queues are subtle. Consider this example: Threads 1, 2 and 3 are
  * sleeping on a wait queue. Now thread 4 wakes up the queue. You would
@@ -92,22 +95,23 @@ typedef struct wait_queue *wait_queue;
  *
  * The solution that we have come up with is as follows. A wait queue
  * consists of a simple list of threads which are sleeping on it. When
- * a thread wishes to sleep on the wait queue, it is added to this list,
- * and it switches back into the reactor context. When a thread wishes
- * to wake up all sleepers, it:
- * (a) copies the list of sleeping pseudothreads into its own private
- *     space
- * (b) clears the list of sleeping pseudothreads
- * (c) registers a prepoll handler to run which will wake up (ie. switch
+ * a thread wishes to sleep on the wait queue, it is added to this list
+ * (the list entry lives on the sleeping thread's own stack), and it
+ * switches back into the reactor context. When a thread wishes to wake
+ * up all sleepers, it:
+ * (a) removes each sleeping pseudothread from the list, so that the
+ *     list is empty
+ * (b) appends each of these threads to the reactor run queue, which
+ *     the reactor drains before it next polls, waking up (ie. switching
  *     into the context of) each of these threads in turn
- * (d) continues to run to completion.
+ * (c) continues to run to completion.
  * A thread which wishes to wake just one pseudothread works similarly
- * except that it only copies (and removes) a single item off the list.
+ * except that it only removes a single item off the list.
  *
  * Note various invariant conditions: A thread cannot be entered on the
  * wait queue sleeping list more than once (because it cannot call
  * sleep_on when it is already sleeping). For similar reasons, a thread
- * cannot be entered on any of the multiple lists at the same time.
+ * cannot be on the wait queue and on the run queue at the same time.
  * This implies that a thread cannot be woken up multiple times.
  *
  * The reader should satisfy themselves that this algorithm is free
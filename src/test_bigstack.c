@@ -22,22 +22,33 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <assert.h>
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <vector.h>
 
 #include "pthr_reactor.h"
 #include "pthr_pseudothread.h"
 
+#define BIG_STACK_SIZE (8 * 1024 * 1024)
+
 static pool test_pool;
 static pseudothread test_pth;
+static int deep_hwm;
 
-/* XXX I suspect that gcc will just turn this into tail recursion,
- * proving nothing.
+/* Use the array after the recursive call, so that gcc cannot turn
+ * this into tail recursion.
  */
-static void
+static int
 recurse (int n)
 {
-  char s[1024];
+  volatile char s[1024];
   s[1023] = 'a';
-  if (n > 0) recurse (n-1);
+  if (n > 0) return recurse (n-1) + s[1023];
+  return s[1023];
 }
 
 static void
@@ -46,6 +57,39 @@ do_test (void *data)
   recurse (100);
 }
 
+static void
+deep_test (void *data)
+{
+  vector v;
+  int i;
+
+  recurse (1000);
+
+  /* The thread used at least 1000 KB, and can't have used more than
+   * its stack.
+   */
+  deep_hwm = pth_get_stack_hwm (current_pth);
+  if (deep_hwm != -1)
+    {
+      assert (deep_hwm >= 1000 * 1024);
+      assert (deep_hwm <= BIG_STACK_SIZE);
+    }
+
+  /* The thread listing reports the same high water mark. */
+  v = pseudothread_get_threads (pth_get_pool (current_pth));
+  for (i = 0; i < vector_size (v); ++i)
+    {
+      pseudothread pth;
+
+      vector_get_ptr (v, i, pth);
+      if (strcmp (pth_get_name (pth), "deep thread") == 0)
+	{
+	  assert (pth_get_stack_size (pth) == BIG_STACK_SIZE);
+	  assert (pth_get_stack_hwm (pth) == deep_hwm);
+	}
+    }
+}
+
 int
 main ()
 {
@@ -55,8 +99,16 @@ main ()
   test_pth = new_pseudothread (test_pool, do_test, 0, "testing thread");
   pth_start (test_pth);
 
+  /* A thread with a big stack of its own. */
+  test_pool = new_pool ();
+  test_pth = new_pseudothread_with_stack (test_pool, deep_test, 0,
+					  "deep thread", BIG_STACK_SIZE);
+  pth_start (test_pth);
+
   while (pseudothread_count_threads () > 0)
     reactor_invoke ();
 
+  printf ("stack high water mark: %d bytes\n", deep_hwm);
+
   exit (0);
 }
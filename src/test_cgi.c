@@ -0,0 +1,333 @@
+/* Test parsing of POSTed CGI parameters.
+ * Copyright (C) 2003 Richard W.M. Jones <rich@annexia.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#include <pool.h>
+
+#include "pthr_pseudothread.h"
+#include "pthr_iolib.h"
+#include "pthr_http.h"
+#include "pthr_cgi.h"
+
+#define MAX_PARAMS 8		/* Most parameters checked per test. */
+#define BIG_FILE_SIZE 20000	/* Size of the upload in the large test. */
+
+/* How the body is sent. */
+#define LENGTH    0		/* With a Content-Length header. */
+#define CHUNKED   1		/* In chunks of 'step' bytes, with a trailer. */
+#define NO_LENGTH 2		/* With no length, connection left open. */
+#define TO_EOF    3		/* With no length, connection closed. */
+#define TRUNCATED 4		/* Content-Length too long, then closed. */
+
+struct param
+{
+  const char *name;
+  const char *value;		/* Expected value, or NULL if absent. */
+  const char *filename;		/* Filename, if this is an uploaded file. */
+};
+
+struct test
+{
+  const char *name;
+  const char *version;		/* HTTP version of the request. */
+  const char *content_type;	/* Content-Type header, or NULL. */
+  const char *body;
+  int framing;
+  int ok;			/* Should new_cgi succeed? */
+  struct param params[MAX_PARAMS];
+};
+
+#define MULTIPART "multipart/form-data; boundary=XyZ"
+
+static char long_name[2048];
+static char big_body[BIG_FILE_SIZE + 1024];
+static char big_file[BIG_FILE_SIZE + 1];
+
+static struct test tests[] = {
+  { "urlencoded", "1.1", 0,
+    "a=1&b=hello+world&c=%41%42%4&d&e=%zz&=x&f=%4",
+    LENGTH, 1,
+    { { "a", "1" }, { "b", "hello world" }, { "c", "AB%4" },
+      { "d", "1" }, { "e", "%zz" }, { "", "x" }, { "f", "%4" } } },
+  { "urlencoded, trailing %", "1.1",
+    "application/x-www-form-urlencoded", "a=%&b",
+    LENGTH, 1,
+    { { "a", "%" }, { "b", "1" } } },
+  { "urlencoded, HTTP/1.0 to EOF", "1.0", 0, "a=1&b=2",
+    TO_EOF, 1,
+    { { "a", "1" }, { "b", "2" } } },
+  { "urlencoded, HTTP/1.1 without length", "1.1", 0, "a=1",
+    NO_LENGTH, 1,
+    { { "a", 0 } } },
+  { "urlencoded, truncated", "1.1", 0, "a=1&b=2",
+    TRUNCATED, 0 },
+  { "urlencoded, long name", "1.1", 0, long_name,
+    LENGTH, 0 },
+  { "multipart", "1.1", MULTIPART,
+    "preamble\r\n--XyZ\r\n"
+    "--XyZ  \t\r\n"		/* Transport padding. */
+    "Content-Disposition: form-data; name=\"field\"\r\n"
+    "\r\n"
+    "value one\r\n"
+    "--XyZ\r\n"
+    "Content-Disposition: form-data; name=\"up\"; filename=\"a.txt\"\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+    "line 1\r\n--Xy\r\n-- end\r\n"
+    "--XyZ\r\n"
+    "Content-Disposition: form-data; name=\"empty\"\r\n"
+    "\r\n"
+    "\r\n"
+    "--XyZ--\r\n"
+    "epilogue\r\n--XyZ\r\n",
+    LENGTH, 1,
+    { { "field", "value one" },
+      { "up", "line 1\r\n--Xy\r\n-- end", "a.txt" },
+      { "empty", "" } } },
+  { "multipart, no final delimiter", "1.1", MULTIPART,
+    "--XyZ\r\n"
+    "Content-Disposition: form-data; name=\"field\"\r\n"
+    "\r\n"
+    "value\r\n",
+    LENGTH, 0 },
+  { "multipart, no name", "1.1", MULTIPART,
+    "--XyZ\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+    "value\r\n"
+    "--XyZ--\r\n",
+    LENGTH, 0 },
+  { "multipart, no boundary", "1.1", "multipart/form-data",
+    "--XyZ--\r\n",
+    LENGTH, 0 },
+  { "multipart, large upload", "1.1", MULTIPART, big_body,
+    LENGTH, 1,
+    { { "big", big_file, "big.bin" }, { "after", "yes" } } },
+  { "unknown content type", "1.1", "text/plain", "a=1",
+    LENGTH, 0 },
+};
+
+#define NR_TESTS (sizeof tests / sizeof tests[0])
+
+static struct test *test;
+static int step, spill;
+
+/* Check a parameter which was kept in memory, or spilled to a file. */
+static void
+check_param (cgi c, struct param *p)
+{
+  const char *value = cgi_param (c, p->name);
+  const char *path = cgi_param_file (c, p->name);
+  char *buf;
+  int fd, len, n;
+
+  if (!p->value)
+    {
+      assert (value == 0);
+      return;
+    }
+  assert (value != 0);
+
+  /* Only uploaded files are spilled, and only when they are large. */
+  len = strlen (p->value);
+  if (!p->filename || len <= spill)
+    {
+      assert (path == 0);
+      assert (strcmp (value, p->value) == 0);
+      return;
+    }
+
+  assert (strcmp (value, p->filename) == 0);
+  assert (path != 0);
+  buf = pmalloc (pth_get_pool (current_pth), len + 1);
+  fd = open (path, O_RDONLY);
+  assert (fd >= 0);
+  n = read (fd, buf, len + 1);
+  close (fd);
+  assert (n == len);
+  assert (memcmp (buf, p->value, len) == 0);
+}
+
+static void
+run (void *vp)
+{
+  pool pool = new_subpool (pth_get_pool (current_pth));
+  io_handle io = io_fdopen (*(int *) vp);
+  http_request h;
+  cgi c;
+  int i;
+
+  h = new_http_request (pool, io);
+  assert (h != 0);
+  c = new_cgi (pool, h, io);
+
+  if (!test->ok)
+    assert (c == 0);
+  else
+    {
+      assert (c != 0);
+      for (i = 0; i < MAX_PARAMS && test->params[i].name; ++i)
+	check_param (c, &test->params[i]);
+    }
+
+  delete_pool (pool);
+  io_fclose (io);
+}
+
+/* Send the request from the other end of the socket, then wait for
+ * the reader to close its end.
+ */
+static void
+write_request (void *vp)
+{
+  io_handle io = io_fdopen (*(int *) vp);
+  const char *body = test->body;
+  int len = strlen (body), i, n;
+
+  io_fprintf (io, "POST /test HTTP/%s\r\n", test->version);
+  if (test->content_type)
+    io_fprintf (io, "Content-Type: %s\r\n", test->content_type);
+
+  switch (test->framing)
+    {
+    case LENGTH:
+      io_fprintf (io, "Content-Length: %d\r\n\r\n", len);
+      io_fputs (body, io);
+      break;
+    case TRUNCATED:
+      io_fprintf (io, "Content-Length: %d\r\n\r\n", len + 10);
+      io_fputs (body, io);
+      break;
+    case CHUNKED:
+      io_fputs ("Transfer-Encoding: chunked\r\n\r\n", io);
+      for (i = 0; i < len; i += n)
+	{
+	  n = len - i < step ? len - i : step;
+	  io_fprintf (io, "%x\r\n", n);
+	  io_fwrite (body + i, 1, n, io);
+	  io_fputs ("\r\n", io);
+	}
+      io_fputs ("0\r\nX-Trailer: yes\r\n\r\n", io);
+      break;
+    default:
+      io_fputs ("\r\n", io);
+      io_fputs (body, io);
+    }
+  io_fflush (io);
+
+  if (test->framing != NO_LENGTH)
+    shutdown (io_fileno (io), SHUT_WR);
+  while (io_fgetc (io) != EOF)
+    ;
+  io_fclose (io);
+}
+
+static void
+run_test (int _step)
+{
+  int sv[2], i;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    { perror ("socketpair"); exit (1); }
+  for (i = 0; i < 2; ++i)
+    if (fcntl (sv[i], F_SETFL, O_NONBLOCK) == -1)
+      abort ();
+
+  step = _step;
+  pth_start (new_pseudothread (new_subpool (global_pool), run, &sv[0],
+			       "reader"));
+  pth_start (new_pseudothread (new_subpool (global_pool), write_request,
+			       &sv[1], "writer"));
+  while (pseudothread_count_threads () > 0)
+    reactor_invoke ();
+}
+
+int
+main ()
+{
+  static int steps[] = { 1, 2, 3, 7, 100000 };
+  static int spills[] = { 65536, 16, 0 };
+  unsigned i, j, k;
+  char *p;
+
+  /* A parameter name one byte too long. */
+  memset (long_name, 'x', 1025);
+  strcpy (long_name + 1025, "=1");
+
+  /* An upload larger than the buffer used to read the body, so that
+   * the delimiter is searched for across several reads.
+   */
+  for (i = 0; i < BIG_FILE_SIZE; ++i)
+    big_file[i] = "\r\n-XyZ0123"[i % 10];
+  p = big_body;
+  p += sprintf (p, "--XyZ\r\nContent-Disposition: form-data; name=\"big\"; "
+		"filename=\"big.bin\"\r\n\r\n");
+  memcpy (p, big_file, BIG_FILE_SIZE);
+  p += BIG_FILE_SIZE;
+  sprintf (p, "\r\n--XyZ\r\nContent-Disposition: form-data; name=\"after\"\r\n"
+	   "\r\nyes\r\n--XyZ--\r\n");
+
+  /* Each test is run with the body sent all at once, and again in
+   * small chunks so that every escape and delimiter is split between
+   * reads.
+   */
+  for (i = 0; i < NR_TESTS; ++i)
+    {
+      test = &tests[i];
+      for (j = 0; j < sizeof spills / sizeof spills[0]; ++j)
+	{
+	  spill = spills[j];
+	  cgi_set_spill_size (spill);
+
+	  run_test (0);
+	  if (test->framing == LENGTH)
+	    {
+	      test->framing = CHUNKED;
+	      for (k = 0; k < sizeof steps / sizeof steps[0]; ++k)
+		run_test (steps[k]);
+	      test->framing = LENGTH;
+	    }
+	}
+      printf ("%-36s ok\n", test->name);
+    }
+
+  exit (0);
+}
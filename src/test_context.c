@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 
@@ -31,16 +32,22 @@
 #include <setjmp.h>
 #endif
 
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
 #include "pthr_context.h"
 
 #define STACK_SIZE 4096
 #define MARKER_SIZE 16
+#define NR_SWITCHES 1000000	/* Number of switches in the benchmark. */
 
 static unsigned char stack [MARKER_SIZE+STACK_SIZE+MARKER_SIZE];
 static mctx_t ctx, calling_ctx;
 static int called = 0;
 static void fn (void *);
 static void setjmp_test (void *);
+static void ping_pong (void *);
 static jmp_buf jb;
 
 #define DATA ((void *) 0x12546731)
@@ -49,6 +56,8 @@ int
 main ()
 {
   int i;
+  struct timeval start, end;
+  double ms;
 
   /* Place magic numbers into the marker areas at each end of the stack, so
    * we can detect stack overrun.
@@ -69,6 +78,24 @@ main ()
   mctx_set (&ctx, setjmp_test, DATA, stack + MARKER_SIZE, STACK_SIZE);
   mctx_switch (&calling_ctx, &ctx);
 
+  /* Benchmark: switch back and forth between two contexts. */
+  mctx_set (&ctx, ping_pong, DATA, stack + MARKER_SIZE, STACK_SIZE);
+  called = 0;
+  gettimeofday (&start, 0);
+  for (i = 0; i < NR_SWITCHES / 2; ++i)
+    mctx_switch (&calling_ctx, &ctx);
+  gettimeofday (&end, 0);
+  assert (called == NR_SWITCHES / 2);
+
+  ms = (end.tv_sec - start.tv_sec) * 1000. +
+    (end.tv_usec - start.tv_usec) / 1000.;
+  if (ms < 1) ms = 1;
+  printf ("%d context switches in %.0f ms (%.0f switches/second)\n",
+	  NR_SWITCHES, ms, NR_SWITCHES / ms * 1000.);
+
+  for (i = 0; i < MARKER_SIZE; ++i)
+    assert (stack[i] == 0xeb && stack[i + MARKER_SIZE+STACK_SIZE] == 0xeb);
+
   exit (0);
 }
 
@@ -97,3 +124,14 @@ call_longjmp ()
 {
   longjmp (jb, 1);
 }
+
+static void
+ping_pong (void *data)
+{
+  assert (data == DATA);
+  for (;;)
+    {
+      called++;
+      mctx_switch (&ctx, &calling_ctx);
+    }
+}
@@ -67,6 +67,8 @@ test_timeout (void *data)
 static void
 do_test (void *data)
 {
+  unsigned long hits, misses;
+
   /* Check current_pth set correctly on thread start. */
   assert (current_pth == test_pth);
 
@@ -109,6 +111,10 @@ do_test (void *data)
   assert (thread_has_run == 1);
   assert (current_pth == test_pth);
   while (!pool_gone) { pth_millisleep (100); }
+
+  /* The stacks of the threads which have exited should have been reused. */
+  pseudothread_get_stack_cache_stats (&hits, &misses, 0);
+  assert (hits >= 2);
 }
 
 int
@@ -32,22 +32,30 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
 #include <pool.h>
 
 #include "pthr_reactor.h"
 
 static void set_flag (void *data) { int *flag = (int *) data; *flag = 1; }
 static void set_flag_h (int s, int e, void *data) { int *flag = (int *) data; *flag = 1; }
+static void count_h (int s, int e, void *data) { int *count = (int *) data; (*count)++; }
+
+#define NR_PIPES 100
 
 int
 main ()
 {
-  int p1[2], p2[2];
-  reactor_handle h1, h2;
+  int p1[2], p2[2], sv[2], pp[NR_PIPES][2], i, count, expected;
+  reactor_handle h1, h2, hp[NR_PIPES];
   int flag1 = 0, flag2 = 0, flag3 = 0;
   char c = '\0';
   reactor_timer t1;
   reactor_prepoll pre1;
+  pool sp;
 
   /* Create some pipes. */
   if (pipe (p1) < 0) { perror ("pipe"); exit (1); }
@@ -85,6 +93,88 @@ main ()
   reactor_unregister (h2);
   reactor_unregister_prepoll (pre1);
 
+  /* Register a reader and a writer on the same socket. The writer
+   * should fire, but not the reader, and unregistering the writer
+   * should leave the reader working.
+   */
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    { perror ("socketpair"); exit (1); }
+  h1 = reactor_register (sv[0], REACTOR_READ, set_flag_h, &flag1);
+  h2 = reactor_register (sv[0], REACTOR_WRITE, set_flag_h, &flag2);
+  reactor_invoke ();
+  assert (flag1 == 0);
+  assert (flag2 == 1);
+  flag2 = 0;
+  reactor_unregister (h2);
+  write (sv[1], &c, 1);
+  reactor_invoke ();
+  assert (flag1 == 1);
+  assert (flag2 == 0);
+  flag1 = 0;
+  read (sv[0], &c, 1);
+  reactor_unregister (h1);
+  close (sv[0]);
+  close (sv[1]);
+
+  /* Register lots of handles, then unregister them in a different
+   * order from the one we registered them in, checking that only
+   * the ready ones fire each time.
+   */
+  for (i = 0; i < NR_PIPES; ++i)
+    {
+      if (pipe (pp[i]) < 0) { perror ("pipe"); exit (1); }
+      hp[i] = reactor_register (pp[i][0], REACTOR_READ, count_h, &count);
+    }
+  for (i = 0, expected = 0; i < NR_PIPES; i += 3, expected++)
+    write (pp[i][1], &c, 1);
+  count = 0;
+  reactor_invoke ();
+  assert (count == expected);
+  for (i = 0; i < NR_PIPES; i += 2)
+    {
+      reactor_unregister (hp[i]);
+      if (i % 3 == 0) expected--;
+    }
+  count = 0;
+  reactor_invoke ();
+  assert (count == expected);
+  for (i = 1; i < NR_PIPES; i += 2)
+    reactor_unregister (hp[i]);
+  for (i = 0; i < NR_PIPES; ++i)
+    {
+      close (pp[i][0]);
+      close (pp[i][1]);
+    }
+
+  /* Attach a descriptor. Events which arrive while no handle is
+   * registered are remembered and delivered to the next handle.
+   */
+  sp = new_subpool (global_pool);
+  if (pipe (p1) < 0) { perror ("pipe"); exit (1); }
+  if (fcntl (p1[0], F_SETFL, O_NONBLOCK) < 0) { perror ("fcntl"); exit (1); }
+  reactor_attach_fd (sp, p1[0]);
+  write (p1[1], &c, 1);
+  t1 = reactor_set_timer (global_pool, 100, set_flag, &flag3);
+  reactor_invoke ();
+  h1 = reactor_register (p1[0], REACTOR_READ, set_flag_h, &flag1);
+  reactor_invoke ();
+  assert (flag1 == 1);
+  flag1 = 0;
+  reactor_unregister (h1);
+  read (p1[0], &c, 1);
+  h1 = reactor_register (p1[0], REACTOR_READ, set_flag_h, &flag1);
+  write (p1[1], &c, 1);
+  reactor_invoke ();
+  assert (flag1 == 1);
+  flag1 = 0;
+  reactor_unregister (h1);
+  read (p1[0], &c, 1);
+  while (!flag3) reactor_invoke ();
+  flag3 = 0;
+  delete_pool (sp);
+  close (p1[0]);
+  close (p1[1]);
+
   /* Register a timer function. */
   t1 = reactor_set_timer (global_pool, 1000, set_flag, &flag1);
   sleep (2);
@@ -0,0 +1,226 @@
+/* Test the reactor timers, and compare them with the old delta queue.
+ * Copyright (C) 2003 Richard W.M. Jones <rich@annexia.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <pool.h>
+
+#include "pthr_reactor.h"
+
+#define NR_TIMERS 1000		/* Number of timers to test. */
+#define MAX_TIMEOUT 600		/* Longest timeout tested (ms). */
+#define NR_LONG_TIMERS 100	/* Number of long timers to cancel. */
+#define NR_BENCH_TIMERS 20000	/* Number of timers in the benchmark. */
+
+struct test_timer
+{
+  reactor_time_t expires;
+  int cancelled;
+  int fired;
+};
+
+static struct test_timer timers[NR_TIMERS];
+static int nr_fired = 0;
+static reactor_time_t last_expires = 0;
+
+static void
+fire (void *data)
+{
+  struct test_timer *t = (struct test_timer *) data;
+
+  assert (!t->cancelled);
+  assert (!t->fired);
+  assert (reactor_time >= t->expires);
+  assert (t->expires >= last_expires);
+
+  last_expires = t->expires;
+  t->fired = 1;
+  nr_fired++;
+}
+
+static void
+never (void *data)
+{
+  abort ();
+}
+
+/* This is the delta queue which the reactor used to use, so that we can
+ * compare it with the timer wheel.
+ */
+struct list_timer
+{
+  pool pool;
+  struct list_timer *prev, *next;
+  unsigned long long delta;
+};
+
+static struct list_timer *head_timer = 0;
+
+static void
+list_remove_timer (void *timerp)
+{
+  struct list_timer *timer = (struct list_timer *) timerp;
+
+  if (timer->prev != 0)
+    timer->prev->next = timer->next;
+  else
+    head_timer = timer->next;
+
+  if (timer->next != 0)
+    {
+      timer->next->prev = timer->prev;
+      timer->next->delta += timer->delta;
+    }
+}
+
+static struct list_timer *
+list_set_timer (pool pp, int timeout)
+{
+  pool sp;
+  struct list_timer *timer, *p, *last_p;
+  unsigned long long trigger_time, this_time;
+
+  sp = new_subpool (pp);
+  timer = pmalloc (sp, sizeof *timer);
+  timer->pool = sp;
+  pool_register_cleanup_fn (sp, list_remove_timer, timer);
+
+  trigger_time = reactor_time + timeout;
+
+  if (head_timer == 0)
+    {
+      timer->prev = timer->next = 0;
+      timer->delta = trigger_time;
+      return head_timer = timer;
+    }
+
+  this_time = 0;
+  last_p = 0;
+  for (p = head_timer; p; last_p = p, p = p->next)
+    {
+      this_time += p->delta;
+
+      if (this_time >= trigger_time)
+	{
+	  timer->prev = p->prev;
+	  timer->next = p;
+	  if (p->prev)
+	    p->prev->next = timer;
+	  else
+	    head_timer = timer;
+	  p->prev = timer;
+	  timer->delta = trigger_time - (this_time - p->delta);
+	  p->delta = this_time - trigger_time;
+	  return timer;
+	}
+    }
+
+  last_p->next = timer;
+  timer->prev = last_p;
+  timer->next = 0;
+  timer->delta = trigger_time - this_time;
+  return timer;
+}
+
+static int
+elapsed_ms (struct timeval *start)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, 0);
+  return (tv.tv_sec - start->tv_sec) * 1000 +
+    (tv.tv_usec - start->tv_usec) / 1000;
+}
+
+int
+main ()
+{
+  int i, expected = 0, wheel_ms, list_ms;
+  reactor_timer long_timers[NR_LONG_TIMERS];
+  static reactor_timer wheel_timers[NR_BENCH_TIMERS];
+  static struct list_timer *list_timers[NR_BENCH_TIMERS];
+  struct timeval start;
+
+  srand (1);
+
+  /* Set lots of timers, and cancel some of them straightaway. */
+  for (i = 0; i < NR_TIMERS; ++i)
+    {
+      int timeout = rand () % MAX_TIMEOUT;
+      reactor_timer t;
+
+      timers[i].expires = reactor_time + timeout;
+      t = reactor_set_timer (global_pool, timeout, fire, &timers[i]);
+      if (i % 3 == 0)
+	{
+	  timers[i].cancelled = 1;
+	  reactor_unset_timer_early (t);
+	}
+      else
+	expected++;
+    }
+
+  /* Set some long timers which should go into the higher levels. */
+  for (i = 0; i < NR_LONG_TIMERS; ++i)
+    long_timers[i] = reactor_set_timer (global_pool,
+					(1 << 14) + rand () % (1 << 30),
+					never, 0);
+
+  /* Wait for the timers to fire, in order and not early. */
+  while (nr_fired < expected)
+    reactor_invoke ();
+
+  for (i = 0; i < NR_TIMERS; ++i)
+    assert (timers[i].fired == !timers[i].cancelled);
+
+  for (i = 0; i < NR_LONG_TIMERS; ++i)
+    reactor_unset_timer_early (long_timers[i]);
+
+  /* Benchmark: set and then cancel lots of timers with timeouts of up
+   * to a minute, as if they were idle timeouts on connections.
+   */
+  gettimeofday (&start, 0);
+  for (i = 0; i < NR_BENCH_TIMERS; ++i)
+    wheel_timers[i] = reactor_set_timer (global_pool, rand () % 60000,
+					 never, 0);
+  for (i = 0; i < NR_BENCH_TIMERS; ++i)
+    reactor_unset_timer_early (wheel_timers[i]);
+  wheel_ms = elapsed_ms (&start);
+
+  gettimeofday (&start, 0);
+  for (i = 0; i < NR_BENCH_TIMERS; ++i)
+    list_timers[i] = list_set_timer (global_pool, rand () % 60000);
+  for (i = 0; i < NR_BENCH_TIMERS; ++i)
+    delete_pool (list_timers[i]->pool);
+  list_ms = elapsed_ms (&start);
+
+  printf ("%d timers set and cancelled: timer wheel %d ms, delta queue %d ms\n",
+	  NR_BENCH_TIMERS, wheel_ms, list_ms);
+
+  exit (0);
+}
@@ -0,0 +1,133 @@
+/* Measure the cost of waking up pseudothreads.
+ * Copyright (C) 2003 Richard W.M. Jones <rich@annexia.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * $Id$
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "pthr_reactor.h"
+#include "pthr_pseudothread.h"
+
+#define NR_ROUND_TRIPS 100000	/* Number of round trips per test. */
+
+/* Two threads pass a byte back and forth through a pair of pipes, so
+ * every round trip makes each thread block and wake up once.
+ */
+struct player
+{
+  int in, out;
+  const char *lang, *tz;
+  int serve;
+};
+
+static void
+play (void *vp)
+{
+  struct player *p = (struct player *) vp;
+  char c = 'x';
+  int i;
+
+  if (p->lang) pth_set_language (p->lang);
+  if (p->tz) pth_set_tz (p->tz);
+
+  for (i = 0; i < NR_ROUND_TRIPS; ++i)
+    {
+      if (p->serve && pth_write (p->out, &c, 1) != 1) abort ();
+      if (pth_read (p->in, &c, 1) != 1) abort ();
+      if (!p->serve && pth_write (p->out, &c, 1) != 1) abort ();
+
+      /* Each thread must still see its own settings after waking up. */
+      if (p->lang) assert (strcmp (getenv ("LANGUAGE"), p->lang) == 0);
+      if (p->tz) assert (strcmp (getenv ("TZ"), p->tz) == 0);
+    }
+}
+
+static void
+run_test (const char *name,
+	  const char *lang1, const char *tz1,
+	  const char *lang2, const char *tz2)
+{
+  int fds1[2], fds2[2], i;
+  struct player p1, p2;
+  struct timeval start, end;
+  double ms;
+
+  if (pipe (fds1) == -1 || pipe (fds2) == -1) abort ();
+  for (i = 0; i < 2; ++i)
+    if (fcntl (fds1[i], F_SETFL, O_NONBLOCK) == -1 ||
+	fcntl (fds2[i], F_SETFL, O_NONBLOCK) == -1)
+      abort ();
+
+  p1.in = fds1[0]; p1.out = fds2[1]; p1.lang = lang1; p1.tz = tz1;
+  p1.serve = 1;
+  p2.in = fds2[0]; p2.out = fds1[1]; p2.lang = lang2; p2.tz = tz2;
+  p2.serve = 0;
+
+  gettimeofday (&start, 0);
+  pth_start (new_pseudothread (new_subpool (global_pool), play, &p1,
+			       "player 1"));
+  pth_start (new_pseudothread (new_subpool (global_pool), play, &p2,
+			       "player 2"));
+  while (pseudothread_count_threads () > 0)
+    reactor_invoke ();
+  gettimeofday (&end, 0);
+
+  for (i = 0; i < 2; ++i)
+    {
+      close (fds1[i]);
+      close (fds2[i]);
+    }
+
+  ms = (end.tv_sec - start.tv_sec) * 1000. +
+    (end.tv_usec - start.tv_usec) / 1000.;
+  if (ms < 1) ms = 1;
+  printf ("%-34s %d wakeups in %.0f ms (%.0f wakeups/second)\n",
+	  name, 2 * NR_ROUND_TRIPS, ms, 2 * NR_ROUND_TRIPS / ms * 1000.);
+}
+
+int
+main ()
+{
+  run_test ("default language and timezone:", 0, 0, 0, 0);
+  run_test ("same language and timezone:", "fr", "Europe/Paris",
+	    "fr", "Europe/Paris");
+  run_test ("different languages and timezones:", "fr", "Europe/Paris",
+	    "de", "Europe/Berlin");
+
+  exit (0);
+}